@@ -1,11 +1,258 @@
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
 #include <map>
 #include <cmath>
 #include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Встроенные замеры: счётчики, таймеры участков и гистограмма задержек запросов.
+// По умолчанию выключены; тогда каждая точка замера — одна проверка флага,
+// без обращения к часам и атомарным счётчикам. Включаются --stats или из меню.
+enum StatCounter {
+    STAT_COMPARISONS,      // сравнения записей при сортировке, слиянии и поиске
+    STAT_NODE_ALLOCATIONS, // запросы узлов у пулов
+    STAT_SLAB_ALLOCATIONS, // обращения пулов к malloc
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    stat_counter_count
+};
+
+const char* const stat_counter_names[stat_counter_count] = {
+    "comparisons", "node_allocations", "slab_allocations", "bytes_read", "bytes_written"
+};
+
+enum StatTimer {
+    TIMER_LOAD,
+    TIMER_SORT_PASS,       // проход naturalMergeSort или байт поразрядной сортировки
+    TIMER_SORT,
+    TIMER_BUILD_INDEX,
+    TIMER_SEARCH,          // срез индекса по году или диапазону дат
+    TIMER_AVL_INSERT,
+    TIMER_FANO_COUNT,      // проход подсчёта частот
+    TIMER_CODES,           // построение кодов Фано или Хаффмана
+    TIMER_PACK,
+    TIMER_UNPACK,
+    TIMER_QUERY,           // запрос целиком: год, даты, составной, сервис; попадает в гистограмму
+    stat_timer_count
+};
+
+const char* const stat_timer_names[stat_timer_count] = {
+    "load", "sort_pass", "sort", "build_index", "search", "avl_insert",
+    "fano_count", "codes", "pack", "unpack", "query"
+};
+
+// Корзина i — задержки от 2^i до 2^(i+1) нс
+const int latency_buckets = 40;
+
+struct TimerStat {
+    std::atomic<unsigned long long> calls{0};
+    std::atomic<unsigned long long> total_ns{0};
+    std::atomic<unsigned long long> max_ns{0};
+};
+
+struct Stats {
+    bool enabled = false;
+    std::atomic<unsigned long long> counters[stat_counter_count] = {};
+    TimerStat timers[stat_timer_count];
+    std::atomic<unsigned long long> latency[latency_buckets] = {};
+};
+
+Stats stats;
+
+inline void count_stat(StatCounter counter, unsigned long long n = 1) {
+    if (stats.enabled) stats.counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void record_timer(StatTimer timer, unsigned long long ns) {
+    TimerStat& t = stats.timers[timer];
+    t.calls.fetch_add(1, std::memory_order_relaxed);
+    t.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    unsigned long long seen = t.max_ns.load(std::memory_order_relaxed);
+    while (ns > seen && !t.max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+    if (timer == TIMER_QUERY) {
+        int bucket = 0;
+        while (bucket + 1 < latency_buckets && (ns >> (bucket + 1)) != 0) ++bucket;
+        stats.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Замер участка до конца области видимости
+struct ScopedTimer {
+    StatTimer timer;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+
+    explicit ScopedTimer(StatTimer t) : timer(t), active(stats.enabled) {
+        if (active) start = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedTimer() {
+        if (!active) return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        record_timer(timer, (unsigned long long)ns);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+// Верхняя граница корзины, в которой набирается доля fraction всех запросов
+unsigned long long latency_percentile(double fraction) {
+    unsigned long long total = 0;
+    for (int i = 0; i < latency_buckets; ++i) total += stats.latency[i].load();
+    if (total == 0) return 0;
+    unsigned long long seen = 0;
+    for (int i = 0; i < latency_buckets; ++i) {
+        seen += stats.latency[i].load();
+        if (seen >= fraction * total) return 2ULL << i;
+    }
+    return 2ULL << (latency_buckets - 1);
+}
+
+void dump_stats(FILE* out) {
+    fprintf(out, "{\"enabled\":%s,\"counters\":{", stats.enabled ? "true" : "false");
+    for (int c = 0; c < stat_counter_count; ++c) {
+        fprintf(out, "%s\"%s\":%llu", c ? "," : "", stat_counter_names[c], stats.counters[c].load());
+    }
+    fprintf(out, "},\"timers\":{");
+    for (int t = 0; t < stat_timer_count; ++t) {
+        const TimerStat& s = stats.timers[t];
+        unsigned long long calls = s.calls.load();
+        fprintf(out, "%s\"%s\":{\"calls\":%llu,\"total_ms\":%.3f,\"mean_us\":%.3f,\"max_us\":%.3f}",
+                t ? "," : "", stat_timer_names[t], calls, s.total_ns.load() / 1e6,
+                calls ? s.total_ns.load() / 1e3 / calls : 0.0, s.max_ns.load() / 1e3);
+    }
+    fprintf(out, "},\"query_latency\":{\"buckets\":[");
+    bool first = true;
+    for (int i = 0; i < latency_buckets; ++i) {
+        unsigned long long n = stats.latency[i].load();
+        if (n == 0) continue;
+        fprintf(out, "%s{\"le_ns\":%llu,\"count\":%llu}", first ? "" : ",", 2ULL << i, n);
+        first = false;
+    }
+    fprintf(out, "],\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu}}\n",
+            latency_percentile(0.5), latency_percentile(0.9), latency_percentile(0.99));
+}
+
+// Файл для выгрузки при выходе (--stats ФАЙЛ, "-" — stderr)
+const char* stats_path = nullptr;
+
+bool write_stats(const char* path) {
+    if (strcmp(path, "-") == 0) {
+        dump_stats(stderr);
+        return true;
+    }
+    FILE* out = fopen(path, "w");
+    if (!out) return false;
+    dump_stats(out);
+    return fclose(out) == 0;
+}
+
+void write_stats_on_exit() {
+    if (stats_path && !write_stats(stats_path)) fprintf(stderr, "Ошибка записи статистики в %s\n", stats_path);
+}
+
+// Пул узлов одного типа: память выделяется блоками (slab), освобождённые узлы
+// попадают в список свободных и переиспользуются без обращения к malloc/free.
+// Пул общий на тип и не потокобезопасен.
+template<typename T>
+class NodePool {
+private:
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::vector<Slot*> slabs;
+    Slot* free_slots;
+    size_t slab_capacity;
+    size_t slab_used;
+    size_t requests;
+    size_t live;
+
+    NodePool() : free_slots(nullptr), slab_capacity(0), slab_used(0), requests(0), live(0) {}
+    ~NodePool() { release(); }
+
+public:
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    static NodePool& instance() {
+        static NodePool pool;
+        return pool;
+    }
+
+    void* allocate() {
+        count_stat(STAT_NODE_ALLOCATIONS);
+        requests++;
+        live++;
+        if (free_slots) {
+            Slot* slot = free_slots;
+            free_slots = slot->next;
+            return slot;
+        }
+        if (slabs.empty() || slab_used == slab_capacity) {
+            slab_capacity = slab_capacity ? slab_capacity * 2 : 256;
+            if (slab_capacity > 65536) slab_capacity = 65536;
+            count_stat(STAT_SLAB_ALLOCATIONS);
+            Slot* slab = static_cast<Slot*>(malloc(slab_capacity * sizeof(Slot)));
+            if (!slab) throw std::bad_alloc();
+            slabs.push_back(slab);
+            slab_used = 0;
+        }
+        return &slabs.back()[slab_used++];
+    }
+
+    void deallocate(void* p) {
+        if (!p) return;
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = free_slots;
+        free_slots = slot;
+        live--;
+    }
+
+    // Массовое освобождение: все блоки отдаются системе разом.
+    // Вызывать только когда ни один узел из пула больше не используется.
+    void release() {
+        for (Slot* slab : slabs) free(slab);
+        slabs.clear();
+        free_slots = nullptr;
+        slab_capacity = 0;
+        slab_used = 0;
+        requests = 0;
+        live = 0;
+    }
+
+    size_t allocations() const { return requests; }
+    size_t slab_count() const { return slabs.size(); }
+    size_t in_use() const { return live; }
+    size_t saved_allocations() const { return requests - slabs.size(); }
+};
 
 template<typename T>
 class queue {
@@ -14,6 +261,9 @@ private:
         T data;
         Node* next;
         Node(const T& val) : data(val), next(nullptr) {}
+
+        static void* operator new(size_t) { return NodePool<Node>::instance().allocate(); }
+        static void operator delete(void* p) { NodePool<Node>::instance().deallocate(p); }
     };
     
     Node* head;
@@ -88,6 +338,17 @@ public:
     
     bool empty() const { return head == nullptr; }
     size_t size() const { return count; }
+
+    // обход без извлечения элементов; visit возвращает false, чтобы остановить обход
+    template<typename Visit>
+    bool for_each(Visit visit) const {
+        for (Node* curr = head; curr; curr = curr->next) {
+            if (!visit(curr->data)) return false;
+        }
+        return true;
+    }
+
+    static size_t pool_saved_allocations() { return NodePool<Node>::instance().saved_allocations(); }
 };
 
 namespace std {
@@ -107,6 +368,9 @@ struct ListNode {
     Record data;
     ListNode* next;
     ListNode(const Record& val) : data(val), next(nullptr) {}
+
+    static void* operator new(size_t) { return NodePool<ListNode>::instance().allocate(); }
+    static void operator delete(void* p) { NodePool<ListNode>::instance().deallocate(p); }
 };
 
 void free_list(ListNode*& head) {
@@ -117,6 +381,61 @@ void free_list(ListNode*& head) {
     }
 }
 
+void print_pool_stats() {
+    NodePool<ListNode>& list_pool = NodePool<ListNode>::instance();
+    size_t saved = list_pool.saved_allocations() + queue<Record>::pool_saved_allocations()
+                 + queue<Record*>::pool_saved_allocations();
+    printf("Пул узлов: %zu блоков списка, сэкономлено выделений памяти: %zu\n",
+           list_pool.slab_count(), saved);
+}
+
+// Файл базы, отображённый в память: записи читаются на месте, без копирования в список
+struct MappedBase {
+    Record* records;
+    size_t count;
+    size_t size;
+};
+
+bool map_base(const char* filename, MappedBase& base) {
+    base.records = nullptr;
+    base.count = 0;
+    base.size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t count = (size_t)st.st_size / sizeof(Record);
+    if (count == 0) {
+        close(fd);
+        return true;
+    }
+
+    size_t size = count * sizeof(Record);
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    madvise(addr, size, MADV_WILLNEED);
+
+    base.records = static_cast<Record*>(addr);
+    base.count = count;
+    base.size = size;
+    count_stat(STAT_BYTES_READ, size);
+    return true;
+}
+
+void unmap_base(MappedBase& base) {
+    if (base.records) munmap(base.records, base.size);
+    base.records = nullptr;
+    base.count = 0;
+    base.size = 0;
+}
+
 int getch() {
     struct termios oldattr, newattr;
     int ch;
@@ -133,45 +452,141 @@ void clear_screen() {
     printf("\033[2J\033[1;1H");
 }
 
-std::string cp866_to_utf8(const char* src, size_t len) {
-    std::string out;
-    out.reserve(len * 2);
+const unsigned short cp866_table[128] = {
+    0x0410,0x0411,0x0412,0x0413,0x0414,0x0415,0x0416,0x0417,
+    0x0418,0x0419,0x041A,0x041B,0x041C,0x041D,0x041E,0x041F,
+    0x0420,0x0421,0x0422,0x0423,0x0424,0x0425,0x0426,0x0427,
+    0x0428,0x0429,0x042A,0x042B,0x042C,0x042D,0x042E,0x042F,
+    0x0430,0x0431,0x0432,0x0433,0x0434,0x0435,0x0436,0x0437,
+    0x0438,0x0439,0x043A,0x043B,0x043C,0x043D,0x043E,0x043F,
+    0x2591,0x2592,0x2593,0x2502,0x2524,0x2561,0x2562,0x2556,
+    0x2555,0x2563,0x2551,0x2557,0x255D,0x255C,0x255B,0x2510,
+    0x2514,0x2534,0x252C,0x251C,0x2500,0x253C,0x255E,0x255F,
+    0x255A,0x2554,0x2569,0x2566,0x2560,0x2550,0x256C,0x2567,
+    0x2568,0x2564,0x2565,0x2559,0x2558,0x2552,0x2553,0x256B,
+    0x256A,0x2518,0x250C,0x2588,0x2584,0x258C,0x2590,0x2580,
+    0x0440,0x0441,0x0442,0x0443,0x0444,0x0445,0x0446,0x0447,
+    0x0448,0x0449,0x044A,0x044B,0x044C,0x044D,0x044E,0x044F,
+    0x0401,0x0451,0x0404,0x0454,0x0407,0x0457,0x040E,0x045E,
+    0x00B0,0x2219,0x00B7,0x221A,0x2116,0x00A4,0x25A0,0x00A0
+};
 
-    for (size_t i = 0; i < len && src[i] != '\0'; ++i) {
-        unsigned char c = static_cast<unsigned char>(src[i]);
-        if (c < 128) {
-            out.push_back(c);
-        } else {
-            static const unsigned short cp866_table[128] = {
-                0x0410,0x0411,0x0412,0x0413,0x0414,0x0415,0x0416,0x0417,
-                0x0418,0x0419,0x041A,0x041B,0x041C,0x041D,0x041E,0x041F,
-                0x0420,0x0421,0x0422,0x0423,0x0424,0x0425,0x0426,0x0427,
-                0x0428,0x0429,0x042A,0x042B,0x042C,0x042D,0x042E,0x042F,
-                0x0430,0x0431,0x0432,0x0433,0x0434,0x0435,0x0436,0x0437,
-                0x0438,0x0439,0x043A,0x043B,0x043C,0x043D,0x043E,0x043F,
-                0x2591,0x2592,0x2593,0x2502,0x2524,0x2561,0x2562,0x2556,
-                0x2555,0x2563,0x2551,0x2557,0x255D,0x255C,0x255B,0x2510,
-                0x2514,0x2534,0x252C,0x251C,0x2500,0x253C,0x255E,0x255F,
-                0x255A,0x2554,0x2569,0x2566,0x2560,0x2550,0x256C,0x2567,
-                0x2568,0x2564,0x2565,0x2559,0x2558,0x2552,0x2553,0x256B,
-                0x256A,0x2518,0x250C,0x2588,0x2584,0x258C,0x2590,0x2580,
-                0x0440,0x0441,0x0442,0x0443,0x0444,0x0445,0x0446,0x0447,
-                0x0448,0x0449,0x044A,0x044B,0x044C,0x044D,0x044E,0x044F,
-                0x0401,0x0451,0x0404,0x0454,0x0407,0x0457,0x040E,0x045E,
-                0x00B0,0x2219,0x00B7,0x221A,0x2116,0x00A4,0x25A0,0x00A0
-            };
-            unsigned short code = cp866_table[c - 128];
-            if (code < 0x80) {
-                out.push_back((char)code);
-            } else if (code < 0x800) {
-                out.push_back(0xC0 | (code >> 6));
-                out.push_back(0x80 | (code & 0x3F));
+// Готовые последовательности UTF-8 для байтов cp866 0x80-0xFF
+struct Utf8Sequence {
+    unsigned char length;
+    char bytes[3];
+};
+
+struct Cp866Utf8Table {
+    Utf8Sequence seq[128];
+
+    Cp866Utf8Table() {
+        for (int i = 0; i < 128; ++i) {
+            unsigned short code = cp866_table[i];
+            Utf8Sequence& s = seq[i];
+            if (code < 0x800) {
+                s.length = 2;
+                s.bytes[0] = (char)(0xC0 | (code >> 6));
+                s.bytes[1] = (char)(0x80 | (code & 0x3F));
+                s.bytes[2] = 0;
+            } else {
+                s.length = 3;
+                s.bytes[0] = (char)(0xE0 | (code >> 12));
+                s.bytes[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+                s.bytes[2] = (char)(0x80 | (code & 0x3F));
+            }
+        }
+    }
+};
+
+const Cp866Utf8Table cp866_utf8;
+
+// Перекодирует не больше len байт src (до первого NUL) в dst без выделений памяти.
+// В dst должно быть место под 3 * len байт. Возвращает число записанных байт.
+// Участки ASCII без NUL копируются блоками по 32 (AVX2) или 16 (SSE2) байт.
+size_t cp866_to_utf8(const char* src, size_t len, char* dst) {
+    char* out = dst;
+    size_t i = 0;
+    while (i < len) {
+#if defined(__AVX2__)
+        while (i + 32 <= len) {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i zero = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+            if (_mm256_movemask_epi8(_mm256_or_si256(block, zero)) != 0) break;
+            _mm256_storeu_si256((__m256i*)out, block);
+            i += 32;
+            out += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        while (i + 16 <= len) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i zero = _mm_cmpeq_epi8(block, _mm_setzero_si128());
+            if (_mm_movemask_epi8(_mm_or_si128(block, zero)) != 0) break;
+            _mm_storeu_si128((__m128i*)out, block);
+            i += 16;
+            out += 16;
+        }
+#endif
+        // до следующего блока — по байту; выходим на NUL
+        size_t stop = std::min(len, i + 16);
+        for (; i < stop; ++i) {
+            unsigned char c = (unsigned char)src[i];
+            if (c == 0) return out - dst;
+            if (c < 128) {
+                *out++ = (char)c;
             } else {
-                out.push_back(0xE0 | (code >> 12));
-                out.push_back(0x80 | ((code >> 6) & 0x3F));
-                out.push_back(0x80 | (code & 0x3F));
+                const Utf8Sequence& s = cp866_utf8.seq[c - 128];
+                memcpy(out, s.bytes, 3);
+                out += s.length;
+            }
+        }
+    }
+    return out - dst;
+}
+
+std::string cp866_to_utf8(const char* src, size_t len) {
+    std::string out(len * 3, '\0');
+    out.resize(cp866_to_utf8(src, len, &out[0]));
+    return out;
+}
+
+// Обратное преобразование для ввода пользователя; символы вне cp866 заменяются на '?'
+std::string utf8_to_cp866(const char* src) {
+    std::string out;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(src);
+    while (*p) {
+        unsigned int code;
+        int extra;
+        if (*p < 0x80) { code = *p; extra = 0; }
+        else if ((*p & 0xE0) == 0xC0) { code = *p & 0x1F; extra = 1; }
+        else if ((*p & 0xF0) == 0xE0) { code = *p & 0x0F; extra = 2; }
+        else if ((*p & 0xF8) == 0xF0) { code = *p & 0x07; extra = 3; }
+        else {
+            out.push_back('?');
+            p++;
+            continue;
+        }
+        p++;
+        for (; extra > 0 && (*p & 0xC0) == 0x80; --extra, ++p) {
+            code = (code << 6) | (*p & 0x3F);
+        }
+        if (extra > 0) {
+            out.push_back('?');
+            continue;
+        }
+        if (code < 0x80) {
+            out.push_back((char)code);
+            continue;
+        }
+        char ch = '?';
+        for (int i = 0; i < 128; ++i) {
+            if (cp866_table[i] == code) {
+                ch = (char)(128 + i);
+                break;
             }
         }
+        out.push_back(ch);
     }
     return out;
 }
@@ -220,6 +635,7 @@ int compareStreet(const char* a, const char* b, int n = 18) {
 }
 
 bool recordLess(const Record& a, const Record& b) {
+    count_stat(STAT_COMPARISONS);
     int cd = compareDate(a.settleDate, b.settleDate);
     if (cd != 0) return cd < 0;
     return compareStreet(a.street, b.street) < 0;
@@ -338,110 +754,315 @@ void mergeSort(ListNode*& head) {
 }
 
 
-void print_pages(ListNode* head) {
-    if (!head) {
-        printf("Список пуст.\n");
-        getch();
-        return;
+// Слияние двух отсортированных цепочек перестановкой указателей next.
+// При равенстве первой идёт запись из a, поэтому сортировка устойчива.
+ListNode* merge_runs(ListNode* a, ListNode* b) {
+    ListNode* head = nullptr;
+    ListNode** tail = &head;
+    while (a && b) {
+        if (recordLess(b->data, a->data)) {
+            *tail = b;
+            b = b->next;
+        } else {
+            *tail = a;
+            a = a->next;
+        }
+        tail = &(*tail)->next;
     }
+    *tail = a ? a : b;
+    return head;
+}
 
-    int total = 0;
+// Отрезает от списка естественную серию (неубывающий участок) и возвращает остаток
+ListNode* cut_run(ListNode* head) {
     ListNode* curr = head;
-    while (curr) { total++; curr = curr->next; }
+    while (curr->next && !recordLess(curr->next->data, curr->data)) {
+        curr = curr->next;
+    }
+    ListNode* rest = curr->next;
+    curr->next = nullptr;
+    return rest;
+}
 
-    const int page_size = 20;
-    int total_pages = (total + page_size - 1) / page_size;
-    int current_page = 0;
+// Естественное слияние: записи не копируются, меняются только указатели next.
+// Уже отсортированный список обрабатывается за один проход.
+void naturalMergeSort(ListNode*& head) {
+    if (!head || !head->next) return;
 
     while (true) {
-        clear_screen();
-        printf("Страница %d из %d\n", current_page + 1, total_pages);
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
-        printf("|              ФИО               |       Улица        | Дом   | Кв.   |    Дата    |\n");
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
-
-        curr = head;
-        int skip_count = current_page * page_size;
-        while (curr && skip_count > 0) {
-            curr = curr->next;
-            skip_count--;
+        ScopedTimer pass(TIMER_SORT_PASS);
+        ListNode* result = nullptr;
+        ListNode** tail = &result;
+        ListNode* rest = head;
+        int merged = 0;
+
+        while (rest) {
+            ListNode* a = rest;
+            rest = cut_run(a);
+            ListNode* b = nullptr;
+            if (rest) {
+                b = rest;
+                rest = cut_run(b);
+            }
+            *tail = merge_runs(a, b);
+            while (*tail) tail = &(*tail)->next;
+            merged++;
         }
 
-        for (int i = 0; i < page_size && curr; ++i) {
-            const Record& r = curr->data;
-            printf("| %-30s", cp866_to_utf8(r.fio, 32).c_str());
-            printf("| %-18s", cp866_to_utf8(r.street, 18).c_str());
-            printf("| %-5d", r.house);
-            printf("| %-5d", r.flat);
-            printf("| %-10s |\n", cp866_to_utf8(r.settleDate, 10).c_str());
-            curr = curr->next;
-        }
+        head = result;
+        if (merged == 1) break;
+    }
+}
+
+
+// Терминал без построчной буферизации и эха на всё время просмотра,
+// а не на каждое нажатие, как в getch()
+struct RawTerminal {
+    termios saved;
+    bool active;
+
+    RawTerminal() {
+        active = tcgetattr(STDIN_FILENO, &saved) == 0;
+        if (!active) return;
+        termios raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+
+    ~RawTerminal() {
+        if (active) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+};
+
+enum ViewerKey { KEY_NONE, KEY_NEXT, KEY_PREV, KEY_FIRST, KEY_LAST, KEY_PAGE, KEY_RECORD, KEY_EXIT };
+
+// Одно нажатие. Одиночный ESC отличается от стрелок и PgUp/PgDn по тому,
+// пришло ли продолжение последовательности в течение 30 мс
+ViewerKey read_viewer_key() {
+    unsigned char c;
+    if (read(STDIN_FILENO, &c, 1) != 1) return KEY_EXIT;
+    if (c == 10 || c == 13 || c == ' ') return KEY_NEXT;
+    if (c == 127 || c == 8) return KEY_PREV;
+    if (c == 'p' || c == 'P') return KEY_PAGE;
+    if (c == 'r' || c == 'R') return KEY_RECORD;
+    if (c == 'q' || c == 'Q') return KEY_EXIT;
+    if (c != 27) return KEY_NONE;
+
+    pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, 30) <= 0) return KEY_EXIT;
+    char seq[8] = {};
+    ssize_t n = read(STDIN_FILENO, seq, sizeof(seq) - 1);
+    if (n <= 0) return KEY_EXIT;
+    if (!strcmp(seq, "[C") || !strcmp(seq, "[B") || !strcmp(seq, "[6~")) return KEY_NEXT;
+    if (!strcmp(seq, "[D") || !strcmp(seq, "[A") || !strcmp(seq, "[5~")) return KEY_PREV;
+    if (!strcmp(seq, "[H") || !strcmp(seq, "[1~") || !strcmp(seq, "OH")) return KEY_FIRST;
+    if (!strcmp(seq, "[F") || !strcmp(seq, "[4~") || !strcmp(seq, "OF")) return KEY_LAST;
+    return KEY_NONE;
+}
 
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
-        printf("[Enter] След. стр.  [Backspace] Пред. стр.  [ESC] Выход\n");
+void write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) return;
+        data += n;
+        size -= n;
+    }
+}
 
-        int key = getch();
-        if (key == 27) break;
-        else if (key == 10 || key == 13) {
-            if (current_page < total_pages - 1) current_page++;
+// Ввод номера в сыром режиме с эхом; false — отмена по ESC или пустой ввод
+bool read_viewer_number(const char* prompt, size_t& value) {
+    write_all(STDOUT_FILENO, prompt, strlen(prompt));
+    char digits[20];
+    size_t len = 0;
+    while (true) {
+        unsigned char c;
+        if (read(STDIN_FILENO, &c, 1) != 1 || c == 27) return false;
+        if (c == 10 || c == 13) break;
+        if ((c == 127 || c == 8) && len > 0) {
+            --len;
+            write_all(STDOUT_FILENO, "\b \b", 3);
+        } else if (c >= '0' && c <= '9' && len < sizeof(digits) - 1) {
+            digits[len++] = (char)c;
+            write_all(STDOUT_FILENO, (const char*)&c, 1);
         }
-        else if (key == 127 || key == 8) {
-            if (current_page > 0) current_page--;
+    }
+    if (len == 0) return false;
+    digits[len] = '\0';
+    value = strtoull(digits, nullptr, 10);
+    return true;
+}
+
+// Произвольный доступ к страницам: у массива начало страницы — смещение,
+// у списка — указатель на первый узел страницы, собранный за один проход
+struct PageCursor {
+    Record* const* records = nullptr;
+    std::vector<ListNode*> heads;
+    size_t count = 0;
+    size_t page_size = 20;
+
+    size_t pages() const { return (count + page_size - 1) / page_size; }
+
+    // записи страницы page в rows; возвращает их число
+    size_t fetch(size_t page, const Record** rows) const {
+        size_t n = 0;
+        if (records) {
+            for (size_t i = page * page_size; i < count && n < page_size; ++i) rows[n++] = records[i];
+        } else {
+            for (ListNode* node = heads[page]; node && n < page_size; node = node->next) rows[n++] = &node->data;
         }
+        return n;
     }
+};
+
+PageCursor page_cursor(ListNode* head) {
+    PageCursor cursor;
+    for (ListNode* node = head; node; node = node->next, ++cursor.count) {
+        if (cursor.count % cursor.page_size == 0) cursor.heads.push_back(node);
+    }
+    return cursor;
 }
 
-void print_queue_pages(::queue<Record*> q_copy) {
-    if (q_copy.empty()) {
-        printf("Очередь пуста.\n");
-        getch();
-        return;
+PageCursor page_cursor(Record* const* records, size_t count) {
+    PageCursor cursor;
+    cursor.records = records;
+    cursor.count = count;
+    return cursor;
+}
+
+// Страница собирается в заранее выделенном буфере и выводится одним write
+struct PageBuffer {
+    std::vector<char> data;
+    size_t used = 0;
+
+    explicit PageBuffer(size_t page_size) : data(page_size * 256 + 2048) {}
+
+    void append(const char* s, size_t n) {
+        n = std::min(n, data.size() - used);
+        memcpy(data.data() + used, s, n);
+        used += n;
     }
-    std::vector<Record*> records;
-    while (!q_copy.empty()) {
-        records.push_back(q_copy.front());
-        q_copy.pop();
+
+    void append(const char* s) { append(s, strlen(s)); }
+
+    template<typename... Args>
+    void format(const char* fmt, Args... args) {
+        int n = snprintf(data.data() + used, data.size() - used, fmt, args...);
+        if (n > 0) used += std::min((size_t)n, data.size() - used - 1);
     }
-    const int page_size = 20;
-    int total = records.size();
-    int total_pages = (total + page_size - 1) / page_size;
-    int current_page = 0;
 
-    while (true) {
-        clear_screen();
-        printf("Результаты поиска: Страница %d из %d (Всего: %d)\n", current_page + 1, total_pages, total);
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
-        printf("|              ФИО               |       Улица        | Дом   | Кв.   |    Дата    |\n");
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
+    // поле cp866 без хвостовых пробелов, дополненное пробелами до width символов
+    void append_cp866(const char* src, size_t len, size_t width) {
+        len = strnlen(src, len);
+        len = last_non_space(src, (int)len) + 1;
+        if (data.size() - used < len * 3 + width) return;
+        char* out = data.data() + used;
+        char* end = out + cp866_to_utf8(src, len, out);
+        // ширина считается в символах: продолжения UTF-8 не занимают места
+        size_t chars = 0;
+        for (const char* p = out; p < end; ++p) chars += ((unsigned char)*p & 0xC0) != 0x80;
+        out = end;
+        for (size_t i = chars; i < width; ++i) *out++ = ' ';
+        used = out - data.data();
+    }
+};
 
-        int start = current_page * page_size;
-        int end = start + page_size;
-        if (end > total) end = total;
+const char table_rule[] = "+--------------------------------+--------------------+-------+-------+------------+\n";
+
+// marked — номер записи (с нуля), выделяемой на странице после перехода к записи
+void render_page(PageBuffer& out, const PageCursor& cursor, const char* title, size_t page, size_t marked) {
+    const Record* rows[256];
+    size_t n = cursor.fetch(page, rows);
+
+    out.used = 0;
+    out.append("\033[H\033[2J");
+    out.format("%s: Страница %zu из %zu (Всего: %zu)\n", title, page + 1, cursor.pages(), cursor.count);
+    out.append(table_rule);
+    out.append("|              ФИО               |       Улица        | Дом   | Кв.   |    Дата    |\n");
+    out.append(table_rule);
+    for (size_t i = 0; i < n; ++i) {
+        const Record* r = rows[i];
+        bool mark = page * cursor.page_size + i == marked;
+        if (mark) out.append("\033[7m");
+        out.append("| ");
+        out.append_cp866(r->fio, sizeof(r->fio), 31);
+        out.append("| ");
+        out.append_cp866(r->street, sizeof(r->street), 19);
+        out.format("| %-6d| %-6d| ", r->house, r->flat);
+        out.append_cp866(r->settleDate, sizeof(r->settleDate), 11);
+        out.append("|");
+        if (mark) out.append("\033[0m");
+        out.append("\n");
+    }
+    out.append(table_rule);
+    out.append("[Enter/→] След. стр.  [Backspace/←] Пред. стр.  [Home/End] Начало/конец\n"
+               "[p] К странице  [r] К записи  [ESC] Выход\n");
+}
 
-        for (int i = start; i < end; ++i) {
-            const Record* r = records[i];
-            printf("| %-30s", cp866_to_utf8(r->fio, 32).c_str());
-            printf("| %-18s", cp866_to_utf8(r->street, 18).c_str());
-            printf("| %-5d", r->house);
-            printf("| %-5d", r->flat);
-            printf("| %-10s |\n", cp866_to_utf8(r->settleDate, 10).c_str());
-        }
+void view_pages(const PageCursor& cursor, const char* title) {
+    if (cursor.count == 0) {
+        printf("Список пуст.\n");
+        getch();
+        return;
+    }
+    fflush(stdout);
 
-        printf("+--------------------------------+--------------------+-------+-------+------------+\n");
-        printf("[Enter] След. стр.  [Backspace] Пред. стр.  [ESC] Выход\n");
+    RawTerminal terminal;
+    PageBuffer out(cursor.page_size);
+    size_t last_page = cursor.pages() - 1;
+    size_t page = 0;
+    size_t marked = (size_t)-1;
 
-        int key = getch();
-        if (key == 27) break;
-        else if (key == 10 || key == 13) {
-            if (current_page < total_pages - 1) current_page++;
-        }
-        else if (key == 127 || key == 8) {
-            if (current_page > 0) current_page--;
+    while (true) {
+        render_page(out, cursor, title, page, marked);
+        write_all(STDOUT_FILENO, out.data.data(), out.used);
+
+        size_t target = 0;
+        switch (read_viewer_key()) {
+        case KEY_EXIT:
+            return;
+        case KEY_NEXT:
+            if (page < last_page) ++page;
+            break;
+        case KEY_PREV:
+            if (page > 0) --page;
+            break;
+        case KEY_FIRST:
+            page = 0;
+            break;
+        case KEY_LAST:
+            page = last_page;
+            break;
+        case KEY_PAGE:
+            if (read_viewer_number("Номер страницы: ", target) && target > 0) page = std::min(target - 1, last_page);
+            break;
+        case KEY_RECORD:
+            if (read_viewer_number("Номер записи: ", target) && target > 0) {
+                marked = std::min(target, cursor.count) - 1;
+                page = marked / cursor.page_size;
+            }
+            break;
+        case KEY_NONE:
+            break;
         }
     }
 }
 
+void print_pages(ListNode* head) {
+    view_pages(page_cursor(head), "Список");
+}
+
+void print_index_pages(Record* const* records, size_t count) {
+    view_pages(page_cursor(records, count), "Список");
+}
+
+void print_index_pages(const std::vector<Record*>& records) {
+    print_index_pages(records.data(), records.size());
+}
+
 std::vector<Record*> build_index(ListNode* head) {
+    ScopedTimer timer(TIMER_BUILD_INDEX);
     std::vector<Record*> index;
     index.reserve(4000); 
     
@@ -453,131 +1074,805 @@ std::vector<Record*> build_index(ListNode* head) {
     return index;
 }
 
-::queue<Record*> search_with_index(const std::vector<Record*>& index, int year) {
-    ::queue<Record*> result;
-    if (index.empty()) return result;
-    int left = 0;
-    int right = index.size() - 1;
-    int first_occurrence = -1;
-
-    while (left <= right) {
-        int mid = left + (right - left) / 2;
-        int r_year = (index[mid]->settleDate[6] - '0') * 10 + (index[mid]->settleDate[7] - '0');
-        if (r_year == year) {
-            first_occurrence = mid;
-            right = mid - 1;
-        } else if (r_year < year) {
-            left = mid + 1;
-        } else {
-            right = mid - 1;
-        }
+std::vector<Record*> build_index(Record* records, size_t count) {
+    ScopedTimer timer(TIMER_BUILD_INDEX);
+    std::vector<Record*> index(count);
+    for (size_t i = 0; i < count; ++i) {
+        index[i] = records + i;
     }
+    return index;
+}
 
-    if (first_occurrence != -1) {
-        for (size_t i = first_occurrence; i < index.size(); ++i) {
-            int r_year = (index[i]->settleDate[6] - '0') * 10 + (index[i]->settleDate[7] - '0');
-            if (r_year == year) {
-                result.push(index[i]);
-            } else {
-                break;
-            }
-        }
-    }
-    
-    return result;
+bool recordPtrLess(const Record* a, const Record* b) {
+    return recordLess(*a, *b);
 }
 
-struct AVLNode {
-    short house_key;
-    std::vector<Record*> residents;
-    AVLNode* left;
-    AVLNode* right;
-    int height;
+// Группа задач, завершения которых ждёт породивший их поток
+struct TaskGroup {
+    std::atomic<int> pending{0};
+};
 
-    AVLNode(Record* r) : house_key(r->house), left(nullptr), right(nullptr), height(1) {
-        residents.push_back(r);
+// Пул потоков с перехватом работы: у каждого потока своя дека задач,
+// свои задачи берутся с конца, чужие перехватываются с начала.
+// Ожидающий поток не простаивает, а выполняет задачи из пула.
+class TaskPool {
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::pair<std::function<void()>, TaskGroup*>> tasks;
     };
-};
 
-int height(AVLNode* node) {
-    return node ? node->height : 0;
-}
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping{false};
+    std::atomic<int> queued{0};
+    std::mutex sleep_lock;
+    std::condition_variable wake;
 
-int getBalance(AVLNode* node) {
-    return node ? height(node->left) - height(node->right) : 0;
-}
+    static thread_local TaskPool* current_pool;
+    static thread_local size_t current_id;
 
-int max(int a, int b) {
-    return (a > b) ? a : b;
-}
-AVLNode* rightRotate(AVLNode* y) {
-    AVLNode* x = y->left;
-    AVLNode* T2 = x->right;
+    size_t self_id() const {
+        return current_pool == this ? current_id : 0;
+    }
 
-    x->right = y;
-    y->left = T2;
+    bool take(size_t id, std::pair<std::function<void()>, TaskGroup*>& task, bool steal) {
+        Worker& w = *workers[id];
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (w.tasks.empty()) return false;
+        if (steal) {
+            task = std::move(w.tasks.front());
+            w.tasks.pop_front();
+        } else {
+            task = std::move(w.tasks.back());
+            w.tasks.pop_back();
+        }
+        queued--;
+        return true;
+    }
 
-    y->height = max(height(y->left), height(y->right)) + 1;
-    x->height = max(height(x->left), height(x->right)) + 1;
+    void worker_loop(size_t id) {
+        current_pool = this;
+        current_id = id;
+        while (!stopping) {
+            if (run_one()) continue;
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            wake.wait_for(guard, std::chrono::milliseconds(1), [this] {
+                return stopping || queued > 0;
+            });
+        }
+    }
 
-    return x;
-}
+public:
+    // threads — общее число потоков, включая вызывающий (слот 0)
+    explicit TaskPool(unsigned count) {
+        if (count == 0) count = 1;
+        for (unsigned i = 0; i < count; ++i) workers.emplace_back(new Worker());
+        for (unsigned i = 1; i < count; ++i) threads.emplace_back(&TaskPool::worker_loop, this, i);
+    }
 
-AVLNode* leftRotate(AVLNode* x) {
-    AVLNode* y = x->right;
-    AVLNode* T2 = y->left;
+    ~TaskPool() {
+        stopping = true;
+        wake.notify_all();
+        for (std::thread& t : threads) t.join();
+    }
 
-    y->left = x;
-    x->right = T2;
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
 
-    x->height = max(height(x->left), height(x->right)) + 1;
-    y->height = max(height(y->left), height(y->right)) + 1;
+    size_t size() const { return workers.size(); }
 
-    return y;
-}
-AVLNode* insert(AVLNode* node, Record* key) {
-    if (!node) return new AVLNode(key);
+    void spawn(TaskGroup& group, std::function<void()> fn) {
+        group.pending++;
+        Worker& w = *workers[self_id()];
+        {
+            std::lock_guard<std::mutex> guard(w.lock);
+            w.tasks.emplace_back(std::move(fn), &group);
+        }
+        queued++;
+        wake.notify_one();
+    }
 
-    if (key->house < node->house_key)
-        node->left = insert(node->left, key);
-    else if (key->house > node->house_key)
-        node->right = insert(node->right, key);
-    else {
-        node->residents.push_back(key);
+    bool run_one() {
+        size_t id = self_id();
+        std::pair<std::function<void()>, TaskGroup*> task;
+        bool found = take(id, task, false);
+        for (size_t i = 1; !found && i < workers.size(); ++i) {
+            found = take((id + i) % workers.size(), task, true);
+        }
+        if (!found) return false;
+        task.first();
+        task.second->pending--;
+        return true;
     }
 
-    node->height = 1 + max(height(node->left), height(node->right));
-    int balance = getBalance(node);
+    void wait(TaskGroup& group) {
+        while (group.pending > 0) {
+            if (!run_one()) std::this_thread::yield();
+        }
+    }
+};
 
-    if (balance > 1 && key->house < node->left->house_key)
-        return rightRotate(node);
+thread_local TaskPool* TaskPool::current_pool = nullptr;
+thread_local size_t TaskPool::current_id = 0;
 
-    if (balance < -1 && key->house > node->right->house_key)
-        return leftRotate(node);
+const size_t parallel_sort_cutoff = 8192;
+const size_t parallel_merge_cutoff = 16384;
 
-    if (balance > 1 && key->house > node->left->house_key) {
-        node->left = leftRotate(node->left);
-        return rightRotate(node);
+// Устойчивое слияние [a, a+na) и [b, b+nb) в out; большие слияния делятся
+// по медиане большей половины и выполняются параллельно
+void parallel_merge(TaskPool& pool, Record** a, size_t na, Record** b, size_t nb, Record** out) {
+    if (na + nb <= parallel_merge_cutoff) {
+        std::merge(a, a + na, b, b + nb, out, recordPtrLess);
+        return;
     }
 
-    if (balance < -1 && key->house < node->right->house_key) {
-        node->right = rightRotate(node->right);
-        return leftRotate(node);
+    size_t ma, mb;
+    if (na >= nb) {
+        ma = na / 2;
+        mb = std::lower_bound(b, b + nb, a[ma], recordPtrLess) - b;
+    } else {
+        mb = nb / 2;
+        ma = std::upper_bound(a, a + na, b[mb], recordPtrLess) - a;
     }
 
-    return node;
+    TaskGroup group;
+    pool.spawn(group, [&pool, a, ma, b, mb, out] {
+        parallel_merge(pool, a, ma, b, mb, out);
+    });
+    parallel_merge(pool, a + ma, na - ma, b + mb, nb - mb, out + ma + mb);
+    pool.wait(group);
+}
+
+void parallel_sort_to(TaskPool& pool, Record** data, Record** tmp, size_t n);
+
+// Сортирует data на месте, tmp — буфер того же размера
+void parallel_sort_inplace(TaskPool& pool, Record** data, Record** tmp, size_t n) {
+    if (n <= parallel_sort_cutoff) {
+        std::stable_sort(data, data + n, recordPtrLess);
+        return;
+    }
+    size_t mid = n / 2;
+    TaskGroup group;
+    pool.spawn(group, [&pool, data, tmp, mid] {
+        parallel_sort_to(pool, data, tmp, mid);
+    });
+    parallel_sort_to(pool, data + mid, tmp + mid, n - mid);
+    pool.wait(group);
+    parallel_merge(pool, tmp, mid, tmp + mid, n - mid, data);
+}
+
+// Сортирует data, результат оказывается в tmp
+void parallel_sort_to(TaskPool& pool, Record** data, Record** tmp, size_t n) {
+    if (n <= parallel_sort_cutoff) {
+        std::stable_sort(data, data + n, recordPtrLess);
+        std::copy(data, data + n, tmp);
+        return;
+    }
+    size_t mid = n / 2;
+    TaskGroup group;
+    pool.spawn(group, [&pool, data, tmp, mid] {
+        parallel_sort_inplace(pool, data, tmp, mid);
+    });
+    parallel_sort_inplace(pool, data + mid, tmp + mid, n - mid);
+    pool.wait(group);
+    parallel_merge(pool, data, mid, data + mid, n - mid, tmp);
+}
+
+unsigned default_thread_count() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Параллельная устойчивая сортировка массива указателей; порядок совпадает с recordLess.
+// При threads == 1 используется однопоточный std::stable_sort.
+void parallel_sort(std::vector<Record*>& index, unsigned threads) {
+    if (threads <= 1 || index.size() <= parallel_sort_cutoff) {
+        std::stable_sort(index.begin(), index.end(), recordPtrLess);
+        return;
+    }
+    std::vector<Record*> tmp(index.size());
+    TaskPool pool(threads);
+    parallel_sort_inplace(pool, index.data(), tmp.data(), index.size());
+}
+
+// Нормализованный ключ сортировки: упакованная дата и улица, сравниваемые побайтово.
+// Порядок ключей совпадает с recordLess: поля даты разбираются так же, как в compareDate,
+// улица дополняется нулями после последнего непробельного символа, в конце — её длина.
+const int sort_key_size = 24;
+
+struct SortKey {
+    unsigned char bytes[sort_key_size];
+    Record* record;
+};
+
+void make_sort_key(Record* r, SortKey& key) {
+    const char* d = r->settleDate;
+    unsigned long long year = (d[6]-'0')*10 + (d[7]-'0') + 4096;
+    unsigned long long month = (d[3]-'0')*10 + (d[4]-'0') + 4096;
+    unsigned long long day = (d[0]-'0')*10 + (d[1]-'0') + 4096;
+    unsigned long long date = (year << 26) | (month << 13) | day;
+    for (int i = 0; i < 5; ++i) {
+        key.bytes[i] = (unsigned char)(date >> (8 * (4 - i)));
+    }
+
+    int len = 18;
+    while (len > 0 && r->street[len - 1] == ' ') len--;
+    for (int i = 0; i < 18; ++i) {
+        key.bytes[5 + i] = i < len ? (unsigned char)r->street[i] : 0;
+    }
+    key.bytes[23] = (unsigned char)len;
+    key.record = r;
+}
+
+bool sortKeyLess(const SortKey& a, const SortKey& b) {
+    return memcmp(a.bytes, b.bytes, sort_key_size) < 0;
+}
+
+// LSD-поразрядная сортировка ключей: по проходу на байт, начиная с младшего.
+// Гистограммы всех позиций строятся за один проход; позиции, где у всех ключей
+// одинаковый байт, пропускаются. Сортировка устойчивая.
+void radix_sort_keys(std::vector<SortKey>& keys) {
+    size_t n = keys.size();
+    if (n < 2) return;
+
+    std::vector<size_t> counts(sort_key_size * 256, 0);
+    for (const SortKey& key : keys) {
+        for (int pos = 0; pos < sort_key_size; ++pos) {
+            counts[pos * 256 + key.bytes[pos]]++;
+        }
+    }
+
+    std::vector<SortKey> tmp(n);
+    for (int pos = sort_key_size - 1; pos >= 0; --pos) {
+        size_t* count = &counts[pos * 256];
+        if (count[keys[0].bytes[pos]] == n) continue;
+
+        ScopedTimer pass(TIMER_SORT_PASS);
+        size_t offsets[256];
+        size_t sum = 0;
+        for (int b = 0; b < 256; ++b) {
+            offsets[b] = sum;
+            sum += count[b];
+        }
+        for (const SortKey& key : keys) {
+            tmp[offsets[key.bytes[pos]]++] = key;
+        }
+        keys.swap(tmp);
+    }
+}
+
+void radix_sort_index(std::vector<Record*>& index) {
+    std::vector<SortKey> keys(index.size());
+    for (size_t i = 0; i < index.size(); ++i) {
+        make_sort_key(index[i], keys[i]);
+    }
+    radix_sort_keys(keys);
+    for (size_t i = 0; i < index.size(); ++i) {
+        index[i] = keys[i].record;
+    }
+}
+
+enum SortEngine {
+    SORT_NATURAL,
+    SORT_PARALLEL,
+    SORT_RADIX
+};
+
+const char* sort_engine_title(SortEngine engine) {
+    switch (engine) {
+        case SORT_NATURAL: return "Естественное слияние";
+        case SORT_PARALLEL: return "Параллельное слияние";
+        case SORT_RADIX: return "Поразрядная сортировка";
+    }
+    return "";
+}
+
+bool parse_sort_engine(const char* name, SortEngine& engine) {
+    if (strcmp(name, "natural") == 0) engine = SORT_NATURAL;
+    else if (strcmp(name, "parallel") == 0) engine = SORT_PARALLEL;
+    else if (strcmp(name, "radix") == 0) engine = SORT_RADIX;
+    else return false;
+    return true;
+}
+
+// Сортировка индекса вместо списка: переставляются только указатели, записи остаются на месте.
+// Естественное слияние работает только со списком, для массива вместо него берётся параллельное.
+void sort_index(std::vector<Record*>& index, SortEngine engine = SORT_PARALLEL, unsigned threads = 1) {
+    if (engine == SORT_RADIX) radix_sort_index(index);
+    else parallel_sort(index, threads);
+}
+
+// Перестраивает список в порядке индекса; узлы не копируются, меняются только next
+void relink_list(ListNode*& head, const std::vector<Record*>& index) {
+    ListNode** tail = &head;
+    for (Record* r : index) {
+        ListNode* node = reinterpret_cast<ListNode*>(r);
+        *tail = node;
+        tail = &node->next;
+    }
+    *tail = nullptr;
+}
+
+void sort_list(ListNode*& head, SortEngine engine, unsigned threads) {
+    if (engine == SORT_NATURAL) {
+        naturalMergeSort(head);
+        return;
+    }
+    std::vector<Record*> index = build_index(head);
+    sort_index(index, engine, threads);
+    relink_list(head, index);
+}
+
+// Читатель отсортированной серии во временном файле с собственным буфером
+struct RunReader {
+    FILE* file;
+    std::vector<Record> buffer;
+    size_t pos;
+    size_t filled;
+};
+
+bool refill_run(RunReader& run) {
+    run.pos = 0;
+    run.filled = fread(run.buffer.data(), sizeof(Record), run.buffer.size(), run.file);
+    return run.filled > 0;
+}
+
+// k-путевое слияние серий через кучу; при равных записях первой идёт более ранняя серия
+bool merge_runs_to_file(std::vector<FILE*>& runs, FILE* out, size_t memory_budget) {
+    size_t k = runs.size();
+    size_t per_buffer = memory_budget / ((k + 1) * sizeof(Record));
+    if (per_buffer == 0) per_buffer = 1;
+
+    std::vector<RunReader> readers(k);
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < k; ++i) {
+        rewind(runs[i]);
+        readers[i].file = runs[i];
+        readers[i].buffer.resize(per_buffer);
+        if (refill_run(readers[i])) heap.push_back(i);
+    }
+
+    auto greater = [&](size_t a, size_t b) {
+        const Record& ra = readers[a].buffer[readers[a].pos];
+        const Record& rb = readers[b].buffer[readers[b].pos];
+        if (recordLess(ra, rb)) return false;
+        if (recordLess(rb, ra)) return true;
+        return a > b;
+    };
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    std::vector<Record> out_buffer;
+    out_buffer.reserve(per_buffer);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        size_t i = heap.back();
+        RunReader& run = readers[i];
+
+        out_buffer.push_back(run.buffer[run.pos++]);
+        if (out_buffer.size() == per_buffer) {
+            if (fwrite(out_buffer.data(), sizeof(Record), out_buffer.size(), out) != out_buffer.size()) return false;
+            out_buffer.clear();
+        }
+
+        if (run.pos < run.filled || refill_run(run)) {
+            std::push_heap(heap.begin(), heap.end(), greater);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    if (!out_buffer.empty() &&
+        fwrite(out_buffer.data(), sizeof(Record), out_buffer.size(), out) != out_buffer.size()) return false;
+    return true;
+}
+
+void close_runs(std::vector<FILE*>& runs) {
+    for (FILE* f : runs) fclose(f);
+    runs.clear();
+}
+
+// Внешняя сортировка: файл читается кусками в пределах memory_budget байт,
+// каждый кусок сортируется и сбрасывается во временный файл, затем серии сливаются.
+// Если серий больше, чем помещается буферов в бюджет, слияние идёт в несколько проходов.
+bool external_sort(const char* input_filename, const char* output_filename, size_t memory_budget, size_t* runs_created = nullptr) {
+    const size_t min_run_buffer = 1024;
+    if (memory_budget < 4 * min_run_buffer * sizeof(Record)) memory_budget = 4 * min_run_buffer * sizeof(Record);
+
+    FILE* in = fopen(input_filename, "rb");
+    if (!in) {
+        printf("Ошибка открытия файла '%s'\n", input_filename);
+        return false;
+    }
+    // бюджет больше двойного размера файла ничего не даёт, а буферы под него не выделить
+    struct stat st;
+    size_t input_size = fstat(fileno(in), &st) == 0 ? st.st_size : 0;
+    if (input_size && memory_budget / 2 > input_size) {
+        memory_budget = std::max(2 * input_size + sizeof(Record), 4 * min_run_buffer * sizeof(Record));
+    }
+
+    // половина бюджета под записи, половина под буфер устойчивой сортировки
+    std::vector<Record> chunk(memory_budget / (2 * sizeof(Record)));
+    std::vector<FILE*> runs;
+    bool ok = true;
+
+    while (true) {
+        size_t n = fread(chunk.data(), sizeof(Record), chunk.size(), in);
+        if (n == 0) break;
+        std::stable_sort(chunk.begin(), chunk.begin() + n, recordLess);
+
+        FILE* run = tmpfile();
+        if (!run || fwrite(chunk.data(), sizeof(Record), n, run) != n) {
+            if (run) fclose(run);
+            ok = false;
+            break;
+        }
+        runs.push_back(run);
+        if (n < chunk.size()) break;
+    }
+    fclose(in);
+    std::vector<Record>().swap(chunk);
+
+    if (runs_created) *runs_created = runs.size();
+    if (!ok) {
+        close_runs(runs);
+        printf("Ошибка записи временного файла.\n");
+        return false;
+    }
+
+    size_t fan_in = memory_budget / (min_run_buffer * sizeof(Record)) - 1;
+    while (runs.size() > fan_in) {
+        std::vector<FILE*> next_runs;
+        size_t start = 0;
+        while (start < runs.size() && ok) {
+            size_t end = std::min(start + fan_in, runs.size());
+            std::vector<FILE*> group(runs.begin() + start, runs.begin() + end);
+            FILE* merged = tmpfile();
+            ok = merged && merge_runs_to_file(group, merged, memory_budget);
+            if (merged) next_runs.push_back(merged);
+            close_runs(group);
+            start = end;
+        }
+        // серии, не попавшие в группы до ошибки, тоже закрываются
+        for (; start < runs.size(); ++start) fclose(runs[start]);
+        runs.swap(next_runs);
+        if (!ok) {
+            close_runs(runs);
+            printf("Ошибка слияния временных файлов.\n");
+            return false;
+        }
+    }
+
+    FILE* out = fopen(output_filename, "wb");
+    if (!out) {
+        close_runs(runs);
+        printf("Ошибка создания файла '%s'\n", output_filename);
+        return false;
+    }
+    setvbuf(out, nullptr, _IOFBF, 1 << 20);
+    ok = merge_runs_to_file(runs, out, memory_budget);
+    close_runs(runs);
+    if (fclose(out) != 0) ok = false;
+
+    if (!ok) printf("Ошибка записи файла '%s'\n", output_filename);
+    return ok;
+}
+
+// Каталог периодов над отсортированным индексом: период — месяц с ключом yy*12 + mm-1,
+// offsets[p]..offsets[p+1] — срез индекса с записями этого месяца. Год и месяц находятся
+// без поиска, диапазон дат — двоичным поиском внутри двух крайних месяцев.
+const int period_count = 100 * 12;
+
+struct DateDirectory {
+    std::vector<size_t> offsets;  // period_count + 1 смещений; пусто, если каталог не построен
+};
+
+// Срез [begin, end) индекса
+struct IndexRange {
+    size_t begin;
+    size_t end;
+
+    size_t size() const { return end - begin; }
+};
+
+struct QueryDate {
+    int day;
+    int month;
+    int year;
+};
+
+// Дата как число yymmdd, упорядоченное так же, как compareDate
+int date_value(const char* d) {
+    return ((d[6] - '0') * 10 + (d[7] - '0')) * 10000 + ((d[3] - '0') * 10 + (d[4] - '0')) * 100 +
+           (d[0] - '0') * 10 + (d[1] - '0');
+}
+
+int date_value(const QueryDate& q) {
+    return q.year * 10000 + q.month * 100 + q.day;
+}
+
+// Число yymmdd с годом 0..99, месяцем 1..12 и днём 1..31
+bool valid_date_value(int value) {
+    int day = value % 100;
+    int month = value / 100 % 100;
+    int year = value / 10000;
+    return value >= 0 && year <= 99 && month >= 1 && month <= 12 && day >= 1 && day <= 31;
+}
+
+// Ключ периода или -1, если поле даты не вида дд-мм-гг с месяцем 1..12
+int date_period(const char* d) {
+    for (int i : {0, 1, 3, 4, 6, 7}) {
+        if (d[i] < '0' || d[i] > '9') return -1;
+    }
+    int month = (d[3] - '0') * 10 + (d[4] - '0');
+    if (month < 1 || month > 12) return -1;
+    return ((d[6] - '0') * 10 + (d[7] - '0')) * 12 + month - 1;
+}
+
+// Строит каталог за один проход. Если встретилась нестандартная дата, каталог
+// остаётся пустым, и запросы выполняются двоичным поиском по всему индексу.
+bool build_date_directory(const std::vector<Record*>& index, DateDirectory& dir) {
+    dir.offsets.assign(period_count + 1, 0);
+    int previous = 0;
+    for (const Record* r : index) {
+        int period = date_period(r->settleDate);
+        if (period < previous) {
+            dir.offsets.clear();
+            return false;
+        }
+        previous = period;
+        dir.offsets[period + 1]++;
+    }
+    for (int p = 0; p < period_count; ++p) dir.offsets[p + 1] += dir.offsets[p];
+    return true;
+}
+
+// Записи за год (две цифры)
+IndexRange year_range(const std::vector<Record*>& index, const DateDirectory& dir, int year) {
+    ScopedTimer timer(TIMER_SEARCH);
+    if (year < 0 || year > 99) return IndexRange{0, 0};
+    if (!dir.offsets.empty()) return IndexRange{dir.offsets[year * 12], dir.offsets[year * 12 + 12]};
+
+    auto record_year = [](const Record* r) {
+        return (r->settleDate[6] - '0') * 10 + (r->settleDate[7] - '0');
+    };
+    auto first = std::partition_point(index.begin(), index.end(), [&](const Record* r) {
+        return record_year(r) < year;
+    });
+    auto last = std::partition_point(first, index.end(), [&](const Record* r) {
+        return record_year(r) <= year;
+    });
+    return IndexRange{(size_t)(first - index.begin()), (size_t)(last - index.begin())};
+}
+
+// Записи с датами от from до to включительно
+IndexRange date_range(const std::vector<Record*>& index, const DateDirectory& dir,
+                      const QueryDate& from, const QueryDate& to) {
+    ScopedTimer timer(TIMER_SEARCH);
+    int low = date_value(from);
+    int high = date_value(to);
+    if (low > high) return IndexRange{0, 0};
+
+    // границы ищутся только внутри месяцев, в которые попадают from и to
+    size_t lo_begin = 0, lo_end = index.size(), hi_begin = 0, hi_end = index.size();
+    if (!dir.offsets.empty()) {
+        int pf = from.year * 12 + from.month - 1;
+        int pt = to.year * 12 + to.month - 1;
+        // месяц вне каталога: такой даты в базе быть не может
+        int periods = (int)dir.offsets.size() - 1;
+        if (from.month < 1 || from.month > 12 || to.month < 1 || to.month > 12 ||
+            pf < 0 || pf >= periods || pt < 0 || pt >= periods) {
+            return IndexRange{0, 0};
+        }
+        lo_begin = dir.offsets[pf];
+        lo_end = dir.offsets[pf + 1];
+        hi_begin = dir.offsets[pt];
+        hi_end = dir.offsets[pt + 1];
+    }
+
+    auto base = index.begin();
+    auto first = std::partition_point(base + lo_begin, base + lo_end, [low](const Record* r) {
+        return date_value(r->settleDate) < low;
+    });
+    auto last = std::partition_point(base + hi_begin, base + hi_end, [high](const Record* r) {
+        return date_value(r->settleDate) <= high;
+    });
+    return IndexRange{(size_t)(first - base), (size_t)(last - base)};
+}
+
+// Дата запроса дд.мм.гг; разделителем может быть точка или дефис
+bool parse_query_date(const char* text, QueryDate& date) {
+    char sep1 = 0, sep2 = 0;
+    int consumed = 0;
+    if (sscanf(text, "%d%c%d%c%d%n", &date.day, &sep1, &date.month, &sep2, &date.year, &consumed) != 5 ||
+        text[consumed] != '\0') {
+        return false;
+    }
+    bool separators = (sep1 == '.' || sep1 == '-') && (sep2 == '.' || sep2 == '-');
+    return separators && date.day >= 1 && date.day <= 31 && date.month >= 1 && date.month <= 12 &&
+           date.year >= 0 && date.year <= 99;
+}
+
+struct AVLNode {
+    short house_key;
+    std::vector<Record*> residents;
+    AVLNode* left;
+    AVLNode* right;
+    int height;
+
+    AVLNode(Record* r) : house_key(r->house), left(nullptr), right(nullptr), height(1) {
+        residents.push_back(r);
+    };
+};
+
+int height(AVLNode* node) {
+    return node ? node->height : 0;
+}
+
+int getBalance(AVLNode* node) {
+    return node ? height(node->left) - height(node->right) : 0;
+}
+
+int max(int a, int b) {
+    return (a > b) ? a : b;
+}
+AVLNode* rightRotate(AVLNode* y) {
+    AVLNode* x = y->left;
+    AVLNode* T2 = x->right;
+
+    x->right = y;
+    y->left = T2;
+
+    y->height = max(height(y->left), height(y->right)) + 1;
+    x->height = max(height(x->left), height(x->right)) + 1;
+
+    return x;
+}
+
+AVLNode* leftRotate(AVLNode* x) {
+    AVLNode* y = x->right;
+    AVLNode* T2 = y->left;
+
+    y->left = x;
+    x->right = T2;
+
+    x->height = max(height(x->left), height(x->right)) + 1;
+    y->height = max(height(y->left), height(y->right)) + 1;
+
+    return y;
+}
+// Восстанавливает высоту узла и при перекосе больше чем на 1 выполняет поворот;
+// годится и после вставки, и после удаления
+AVLNode* rebalance(AVLNode* node) {
+    node->height = 1 + max(height(node->left), height(node->right));
+    int balance = getBalance(node);
+
+    if (balance > 1) {
+        if (getBalance(node->left) < 0) node->left = leftRotate(node->left);
+        return rightRotate(node);
+    }
+    if (balance < -1) {
+        if (getBalance(node->right) > 0) node->right = rightRotate(node->right);
+        return leftRotate(node);
+    }
+    return node;
+}
+
+// Высота АВЛ-дерева не превышает 1.44·log2(n+2), так что 64 уровней хватает с запасом
+const int avl_max_height = 64;
+
+// Вставка без рекурсии: спуск запоминает ссылки на пройденные узлы,
+// затем балансировка идёт по ним снизу вверх
+AVLNode* insert(AVLNode* root, Record* key) {
+    ScopedTimer timer(TIMER_AVL_INSERT);
+    AVLNode** path[avl_max_height];
+    int depth = 0;
+    AVLNode** link = &root;
+
+    while (*link) {
+        AVLNode* node = *link;
+        if (key->house == node->house_key) {
+            node->residents.push_back(key);
+            return root;
+        }
+        path[depth++] = link;
+        link = key->house < node->house_key ? &node->left : &node->right;
+    }
+    *link = new AVLNode(key);
+
+    while (depth > 0) {
+        AVLNode** up = path[--depth];
+        int old_height = (*up)->height;
+        *up = rebalance(*up);
+        if ((*up)->height == old_height) break;  // выше высоты не изменились
+    }
+    return root;
+}
+
+// Удаляет жильца из его дома; опустевший дом удаляется из дерева
+AVLNode* remove_resident(AVLNode* root, const Record* key) {
+    AVLNode** path[avl_max_height];
+    int depth = 0;
+    AVLNode** link = &root;
+
+    while (*link && (*link)->house_key != key->house) {
+        path[depth++] = link;
+        link = key->house < (*link)->house_key ? &(*link)->left : &(*link)->right;
+    }
+    AVLNode* node = *link;
+    if (!node) return root;
+
+    auto it = std::find(node->residents.begin(), node->residents.end(), key);
+    if (it == node->residents.end()) return root;
+    node->residents.erase(it);
+    if (!node->residents.empty()) return root;
+
+    // у узла с двумя потомками данные заменяются данными преемника, а удаляется преемник
+    if (node->left && node->right) {
+        path[depth++] = link;
+        AVLNode** next = &node->right;
+        while ((*next)->left) {
+            path[depth++] = next;
+            next = &(*next)->left;
+        }
+        node->house_key = (*next)->house_key;
+        node->residents.swap((*next)->residents);
+        link = next;
+    }
+    AVLNode* victim = *link;
+    *link = victim->left ? victim->left : victim->right;
+    delete victim;
+
+    while (depth > 0) {
+        AVLNode** up = path[--depth];
+        *up = rebalance(*up);
+    }
+    return root;
 }
 
 AVLNode* search(AVLNode* root, int house) {
-    if (!root) return nullptr;
+    while (root && root->house_key != house) {
+        root = house < root->house_key ? root->left : root->right;
+    }
+    return root;
+}
+
+// Обход домов с номерами от low до high по возрастанию. Поддеревья вне диапазона
+// не посещаются; если visit вернул false, обход прекращается и функция возвращает false.
+template <typename Visit>
+bool for_each_house(AVLNode* root, int low, int high, Visit visit) {
+    AVLNode* stack[avl_max_height];
+    int depth = 0;
+    AVLNode* node = root;
 
-    if (house == root->house_key)
-        return root;
+    while (true) {
+        while (node) {
+            if (node->house_key >= low) {
+                stack[depth++] = node;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        if (depth == 0) return true;
+        node = stack[--depth];
+        if (node->house_key > high) return true;
+        if (!visit(node)) return false;
+        node = node->right;
+    }
+}
 
-    if (house < root->house_key)
-        return search(root->left, house);
-    else
-        return search(root->right, house);
+void free_tree(AVLNode* root) {
+    std::vector<AVLNode*> stack;
+    if (root) stack.push_back(root);
+    while (!stack.empty()) {
+        AVLNode* node = stack.back();
+        stack.pop_back();
+        if (node->left) stack.push_back(node->left);
+        if (node->right) stack.push_back(node->right);
+        delete node;
+    }
 }
 
 void printTree(AVLNode* root, const std::string& prefix = "", bool isLeft = true) {
@@ -620,6 +1915,77 @@ void printInOrder(AVLNode* root) {
     printInOrder(root->right);
 }
 
+// Плоский индекс домов: различные номера домов в раскладке Эйтцингера (массив-куча,
+// корень в ячейке 1, потомки i — 2i и 2i+1) и один непрерывный массив жильцов,
+// сгруппированных по домам. Поиск идёт без ветвлений по сравнению, жильцы дома
+// лежат подряд в порядке выборки, как в AVLNode::residents.
+struct HouseIndex {
+    std::vector<short> keys;        // 1..house_count в порядке Эйтцингера, keys[0] не используется
+    std::vector<unsigned> first;    // начало жильцов дома keys[i] в residents
+    std::vector<unsigned> count;    // число жильцов дома keys[i]
+    std::vector<Record*> residents;
+};
+
+// Жильцы найденного дома; count == 0, если дома нет
+struct HouseSlice {
+    Record* const* residents;
+    size_t count;
+};
+
+// Раскладывает отсортированные ключи по Эйтцингеру обходом неявного дерева в симметричном порядке
+size_t eytzinger_fill(HouseIndex& index, const std::vector<short>& sorted, const std::vector<unsigned>& offsets,
+                      size_t node, size_t pos) {
+    if (node >= index.keys.size()) return pos;
+    pos = eytzinger_fill(index, sorted, offsets, 2 * node, pos);
+    index.keys[node] = sorted[pos];
+    index.first[node] = offsets[pos];
+    index.count[node] = offsets[pos + 1] - offsets[pos];
+    return eytzinger_fill(index, sorted, offsets, 2 * node + 1, pos + 1);
+}
+
+// Построение за O(n): номер дома читается из записи один раз, пары (дом, запись)
+// устойчиво сортируются поразрядно в два прохода по байтам, затем один проход для границ домов
+void build_house_index(Record* const* records, size_t n, HouseIndex& index) {
+    std::vector<std::pair<unsigned short, Record*>> items(n), buffer(n);
+    for (size_t i = 0; i < n; ++i) items[i] = {(unsigned short)(records[i]->house + 32768), records[i]};
+    for (int shift = 0; shift < 16; shift += 8) {
+        size_t counts[257] = {};
+        for (const auto& item : items) counts[(item.first >> shift & 0xFF) + 1]++;
+        for (int b = 0; b < 256; ++b) counts[b + 1] += counts[b];
+        for (const auto& item : items) buffer[counts[item.first >> shift & 0xFF]++] = item;
+        items.swap(buffer);
+    }
+
+    std::vector<short> sorted;
+    std::vector<unsigned> offsets;
+    index.residents.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        index.residents[i] = items[i].second;
+        if (i == 0 || items[i].first != items[i - 1].first) {
+            sorted.push_back((short)(items[i].first - 32768));
+            offsets.push_back(i);
+        }
+    }
+    offsets.push_back(n);
+
+    index.keys.assign(sorted.size() + 1, 0);
+    index.first.assign(sorted.size() + 1, 0);
+    index.count.assign(sorted.size() + 1, 0);
+    eytzinger_fill(index, sorted, offsets, 1, 0);
+}
+
+// Тот же смысл, что у search(root, house) для АВЛ-дерева
+HouseSlice search(const HouseIndex& index, int house) {
+    const short* keys = index.keys.data();
+    size_t size = index.keys.size();
+    size_t i = 1;
+    while (i < size) i = 2 * i + (keys[i] < house);
+    // после спуска младшие единичные биты i — повороты вправо; их снятие даёт нижнюю границу
+    i >>= __builtin_ffsll(~i);
+    if (i == 0 || keys[i] != house) return HouseSlice{nullptr, 0};
+    return HouseSlice{index.residents.data() + index.first[i], index.count[i]};
+}
+
 std::string fractional_to_binary(double F, int l) {
     std::string result;
     while (l--) {
@@ -634,10 +2000,52 @@ std::string fractional_to_binary(double F, int l) {
     return result;
 }
 
-void fano_split(int L, int R, const std::vector<std::pair<unsigned char, double>>& probs, std::map<unsigned char, std::string>& codes, std::string current_code) {
+// Построитель префиксного кода по гистограмме байтов
+enum CoderEngine {
+    CODER_FANO,
+    CODER_HUFFMAN
+};
+
+const CoderEngine coder_engines[] = {CODER_FANO, CODER_HUFFMAN};
+
+const char* coder_engine_name(CoderEngine coder) {
+    return coder == CODER_HUFFMAN ? "huffman" : "fano";
+}
+
+const char* coder_engine_title(CoderEngine coder) {
+    return coder == CODER_HUFFMAN ? "Хаффман" : "Фано";
+}
+
+bool parse_coder_engine(const char* name, CoderEngine& coder) {
+    if (strcmp(name, "fano") == 0) coder = CODER_FANO;
+    else if (strcmp(name, "huffman") == 0) coder = CODER_HUFFMAN;
+    else return false;
+    return true;
+}
+
+// Код символа: целое число и длина в битах; старший бит кода идёт в поток первым
+struct CodeTable {
+    unsigned long long code[256];
+    unsigned char length[256];
+    CoderEngine coder;  // каким методом построена таблица
+};
+
+const int max_code_length = 64;
+
+std::string code_to_string(unsigned long long code, int length) {
+    std::string result;
+    for (int i = length - 1; i >= 0; --i) {
+        result += (i < 64 && ((code >> i) & 1)) ? '1' : '0';
+    }
+    return result;
+}
+
+void fano_split(int L, int R, const std::vector<std::pair<unsigned char, double>>& probs, CodeTable& codes,
+                unsigned long long current_code, int current_length) {
     if (L > R) return;
     if (L == R) {
-        codes[probs[L].first] = current_code;
+        codes.code[probs[L].first] = current_code;
+        codes.length[probs[L].first] = current_length;
         return;
     }
 
@@ -660,8 +2068,18 @@ void fano_split(int L, int R, const std::vector<std::pair<unsigned char, double>
         }
     }
 
-    fano_split(L, split_index, probs, codes, current_code + "0");
-    fano_split(split_index + 1, R, probs, codes, current_code + "1");
+    // На сильно перекошенном распределении цепочка делений уходит глубже max_code_length.
+    // Каждой половине оставляется не больше символов, чем кодов в оставшихся битах,
+    // так что длина кода не превышает max_code_length; на обычных данных ограничение не срабатывает.
+    int remaining = max_code_length - current_length - 1;
+    if (remaining < 8) {
+        int cap = 1 << remaining;
+        split_index = std::max(split_index, R - cap);
+        split_index = std::min(split_index, L + cap - 1);
+    }
+
+    fano_split(L, split_index, probs, codes, current_code << 1, current_length + 1);
+    fano_split(split_index + 1, R, probs, codes, (current_code << 1) | 1, current_length + 1);
 }
 
 std::string symbol_name(unsigned char ch) {
@@ -725,191 +2143,3861 @@ std::string symbol_name(unsigned char ch) {
 }
 
 
-void encode_fano(const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        printf("Ошибка открытия файла для кодирования.\n");
-        return;
-    }
+const size_t io_block_size = 1 << 20;
 
-    std::map<unsigned char, int> freq;
-    int total = 0;
-    int c;
-    while ((c = fgetc(file)) != EOF) {
-        freq[(unsigned char)c]++;
-        total++;
+// Гистограмма байтов файла, читаемого крупными блоками. Четыре частичные гистограммы
+// убирают зависимость между соседними инкрементами одной ячейки.
+bool count_frequencies(const char* filename, unsigned long long freq[256], unsigned long long& total) {
+    ScopedTimer timer(TIMER_FANO_COUNT);
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+
+    std::vector<unsigned char> block(io_block_size);
+    unsigned long long partial[4][256] = {};
+    total = 0;
+    size_t n;
+    while ((n = fread(block.data(), 1, block.size(), file)) > 0) {
+        const unsigned char* p = block.data();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            partial[0][p[i]]++;
+            partial[1][p[i + 1]]++;
+            partial[2][p[i + 2]]++;
+            partial[3][p[i + 3]]++;
+        }
+        for (; i < n; ++i) partial[0][p[i]]++;
+        total += n;
     }
     fclose(file);
+    count_stat(STAT_BYTES_READ, total);
+
+    for (int c = 0; c < 256; ++c) {
+        freq[c] = partial[0][c] + partial[1][c] + partial[2][c] + partial[3][c];
+    }
+    return true;
+}
+
+// Коды Фано по гистограмме; probs упорядочены по убыванию вероятности
+void build_fano_codes(const unsigned long long freq[256], unsigned long long total,
+                      std::vector<std::pair<unsigned char, double>>& probs, CodeTable& codes) {
+    probs.clear();
+    for (int ch = 0; ch < 256; ++ch) {
+        if (freq[ch]) probs.emplace_back((unsigned char)ch, static_cast<double>(freq[ch]) / total);
+    }
+
+    std::sort(probs.begin(), probs.end(), [](auto& a, auto& b) {
+        return a.second > b.second;
+    });
+
+    memset(&codes, 0, sizeof(codes));
+    codes.coder = CODER_FANO;
+    if (!probs.empty()) {
+        if (probs.size() == 1) {
+            codes.code[probs[0].first] = 0;
+            codes.length[probs[0].first] = 1;
+        }
+        else fano_split(0, probs.size() - 1, probs, codes, 0, 0);
+    }
+}
+
+bool build_fano_codes(const char* filename, std::vector<std::pair<unsigned char, double>>& probs, CodeTable& codes) {
+    unsigned long long freq[256];
+    unsigned long long total = 0;
+    if (!count_frequencies(filename, freq, total)) return false;
+    build_fano_codes(freq, total, probs, codes);
+    return true;
+}
+
+// Длины кодов Хаффмана: листья 0..n-1, внутренние узлы n..2n-2, куча по весу.
+// При равных весах раньше сливается узел с меньшим номером, поэтому результат детерминирован.
+void huffman_lengths(const std::vector<unsigned long long>& weights, std::vector<int>& lengths) {
+    size_t n = weights.size();
+    lengths.assign(n, 0);
+    if (n == 1) {
+        lengths[0] = 1;
+        return;
+    }
+
+    std::vector<int> parent(2 * n - 1, -1);
+    std::vector<std::pair<unsigned long long, size_t>> heap;
+    for (size_t i = 0; i < n; ++i) heap.emplace_back(weights[i], i);
+    auto greater = [](const std::pair<unsigned long long, size_t>& a,
+                      const std::pair<unsigned long long, size_t>& b) { return a > b; };
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    for (size_t next = n; heap.size() > 1; ++next) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        auto a = heap.back();
+        heap.pop_back();
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        auto b = heap.back();
+        heap.pop_back();
+        parent[a.second] = parent[b.second] = next;
+        heap.emplace_back(a.first + b.first, next);
+        std::push_heap(heap.begin(), heap.end(), greater);
+    }
+
+    // родитель всегда имеет больший номер, поэтому глубины считаются одним проходом сверху вниз
+    std::vector<int> depth(2 * n - 1, 0);
+    for (size_t i = 2 * n - 2; i-- > 0;) depth[i] = depth[parent[i]] + 1;
+    for (size_t i = 0; i < n; ++i) lengths[i] = depth[i];
+}
+
+// Канонический код Хаффмана: коды назначаются по возрастанию (длина, символ).
+// Если код длиннее max_code_length, веса делятся пополам и дерево строится заново.
+void build_huffman_codes(const unsigned long long freq[256], CodeTable& codes) {
+    memset(&codes, 0, sizeof(codes));
+    codes.coder = CODER_HUFFMAN;
+
+    std::vector<unsigned char> symbols;
+    std::vector<unsigned long long> weights;
+    for (int ch = 0; ch < 256; ++ch) {
+        if (!freq[ch]) continue;
+        symbols.push_back((unsigned char)ch);
+        weights.push_back(freq[ch]);
+    }
+    if (symbols.empty()) return;
+
+    std::vector<int> lengths;
+    while (true) {
+        huffman_lengths(weights, lengths);
+        if (*std::max_element(lengths.begin(), lengths.end()) <= max_code_length) break;
+        for (unsigned long long& w : weights) w = (w + 1) / 2;
+    }
+
+    std::vector<size_t> order(symbols.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return lengths[a] != lengths[b] ? lengths[a] < lengths[b] : symbols[a] < symbols[b];
+    });
+
+    unsigned long long code = 0;
+    int previous = lengths[order[0]];
+    for (size_t k = 0; k < order.size(); ++k) {
+        int length = lengths[order[k]];
+        if (k > 0) code = (code + 1) << (length - previous);
+        previous = length;
+        codes.code[symbols[order[k]]] = code;
+        codes.length[symbols[order[k]]] = length;
+    }
+}
+
+// Коды выбранным методом по гистограмме
+void build_codes(CoderEngine coder, const unsigned long long freq[256], unsigned long long total, CodeTable& codes) {
+    ScopedTimer timer(TIMER_CODES);
+    if (coder == CODER_HUFFMAN) {
+        build_huffman_codes(freq, codes);
+    } else {
+        std::vector<std::pair<unsigned char, double>> probs;
+        build_fano_codes(freq, total, probs, codes);
+    }
+}
+
+bool build_codes(CoderEngine coder, const char* filename, CodeTable& codes) {
+    unsigned long long freq[256];
+    unsigned long long total = 0;
+    if (!count_frequencies(filename, freq, total)) return false;
+    build_codes(coder, freq, total, codes);
+    return true;
+}
+
+bool encode_fano(const char* filename) {
+    std::vector<std::pair<unsigned char, double>> probs;
+    CodeTable codes;
+    if (!build_fano_codes(filename, probs, codes)) {
+        fprintf(stderr, "Ошибка открытия файла для кодирования.\n");
+        return false;
+    }
+
+    printf("\n+--------+-------------+--------+----------------------------+\n");
+    printf("| Символ | Вероятность | Длина  | Код Фано                   |\n");
+    printf("+--------+-------------+--------+----------------------------+\n");
+    
+    double avgLen = 0.0, entropy = 0.0;
+
+    for (auto& [ch, p] : probs) {
+        int l = codes.length[ch];
+        std::string code = code_to_string(codes.code[ch], l);
+        avgLen += p * l;
+        if (p > 0) entropy += -p * std::log2(p);
+
+        std::string name = symbol_name(ch);
+
+        printf("| %-6s | %10.6f | %7d | %-24s |\n",
+               name.c_str(), p, l, code.c_str());
+    }
+
+    printf("+--------+-------------+--------+----------------------------+\n");
+    printf("Энтропия: H = %.6f бит/символ\n", entropy);
+    printf("Средняя длина кода: L = %.6f бит/символ\n", avgLen);
+    printf("Избыточность: R = L - H = %.6f\n", avgLen - entropy);
+    size_t unique_count = probs.size();
+    printf("Кол-во уник символов: %zu\n", unique_count);
+    return true;
+}
+
+// Заголовок упакованного файла: за ним идут symbol_count записей PackedSymbol и битовый поток
+struct PackedHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned long long original_size;
+    unsigned int symbol_count;
+    unsigned int coder;  // CoderEngine; в версии 1 всегда 0 (Фано)
+};
+
+struct PackedSymbol {
+    unsigned long long code;
+    unsigned char symbol;
+    unsigned char length;
+    unsigned char reserved[6];
+};
+
+const char packed_magic[4] = {'F', 'A', 'N', 'O'};
+const unsigned int packed_version = 2;
+
+bool supported_packed_version(unsigned int version) {
+    return version == 1 || version == packed_version;
+}
+
+// Запись битов старшим вперёд через 64-битный аккумулятор в буфер вызывающего.
+// Коды до 32 бит кладутся одной операцией, длинные — двумя половинами.
+struct BitWriter {
+    unsigned char* out;
+    size_t pos;
+    unsigned long long acc;
+    int fill;
+
+    explicit BitWriter(unsigned char* buffer) : out(buffer), pos(0), acc(0), fill(0) {}
+
+    void put32(unsigned long long code, int length) {
+        acc = (acc << length) | code;
+        fill += length;
+        if (fill >= 32) {
+            unsigned int word = __builtin_bswap32((unsigned int)(acc >> (fill - 32)));
+            memcpy(out + pos, &word, 4);
+            pos += 4;
+            fill -= 32;
+        }
+    }
+
+    void put(unsigned long long code, int length) {
+        if (length > 32) {
+            put32(code >> 32, length - 32);
+            put32(code & 0xFFFFFFFFULL, 32);
+        } else {
+            put32(code, length);
+        }
+    }
+
+    // Дописывает оставшиеся биты, дополняя последний байт нулями
+    void finish() {
+        while (fill >= 8) {
+            out[pos++] = (unsigned char)(acc >> (fill - 8));
+            fill -= 8;
+        }
+        if (fill > 0) {
+            out[pos++] = (unsigned char)(acc << (8 - fill));
+            fill = 0;
+        }
+    }
+};
+
+bool packed_symbols(const CodeTable& codes, std::vector<PackedSymbol>& table) {
+    table.clear();
+    for (int ch = 0; ch < 256; ++ch) {
+        if (!codes.length[ch]) continue;
+        if (codes.length[ch] > max_code_length) return false;
+        PackedSymbol entry = {};
+        entry.symbol = (unsigned char)ch;
+        entry.length = codes.length[ch];
+        entry.code = codes.code[ch];
+        table.push_back(entry);
+    }
+    return true;
+}
+
+bool write_packed_header(FILE* out, const CodeTable& codes, unsigned long long original_size, size_t& header_bytes,
+                         const char* magic = packed_magic) {
+    PackedHeader header = {};
+    memcpy(header.magic, magic, 4);
+    header.version = packed_version;
+    header.original_size = original_size;
+    header.coder = codes.coder;
+
+    std::vector<PackedSymbol> table;
+    if (!packed_symbols(codes, table)) return false;
+    header.symbol_count = table.size();
+
+    header_bytes = sizeof(header) + table.size() * sizeof(PackedSymbol);
+    return fwrite(&header, sizeof(header), 1, out) == 1 &&
+           fwrite(table.data(), sizeof(PackedSymbol), table.size(), out) == table.size();
+}
+
+// Запись битового потока по готовым кодам с заголовком-таблицей кодов; размеры в байтах.
+// Вход читается блоками по io_block_size, выход копится в буфере и пишется такими же блоками.
+bool pack_fano(const char* input_filename, const char* output_filename,
+               const CodeTable& codes, long& original_size, long& compressed_size) {
+    ScopedTimer timer(TIMER_PACK);
+    FILE* file = fopen(input_filename, "rb");
+    FILE* out = fopen(output_filename, "wb");
+    if (!file || !out) {
+        if (file) fclose(file);
+        if (out) fclose(out);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        fclose(out);
+        return false;
+    }
+
+    size_t header_bytes = 0;
+    bool ok = write_packed_header(out, codes, st.st_size, header_bytes);
+
+    // вход кодируется порциями по 64 КБ: в худшем случае 64 бита на байт, плюс запас на неполное слово
+    const size_t chunk = 1 << 16;
+    std::vector<unsigned char> block(io_block_size);
+    std::vector<unsigned char> packed(chunk * 8 + 16);
+    BitWriter writer(packed.data());
+    unsigned long long total_bits = 0;
+    size_t n;
+
+    while (ok && (n = fread(block.data(), 1, block.size(), file)) > 0) {
+        for (size_t start = 0; start < n && ok; start += chunk) {
+            const unsigned char* p = block.data() + start;
+            size_t len = std::min(chunk, n - start);
+            for (size_t i = 0; i < len; ++i) {
+                writer.put(codes.code[p[i]], codes.length[p[i]]);
+            }
+            // в аккумуляторе остаются только биты неполного 32-битного слова
+            ok = fwrite(packed.data(), 1, writer.pos, out) == writer.pos;
+            total_bits += writer.pos * 8;
+            writer.pos = 0;
+        }
+    }
+    total_bits += writer.fill;
+    writer.finish();
+    if (ok && writer.pos) ok = fwrite(packed.data(), 1, writer.pos, out) == writer.pos;
+
+    fclose(file);
+    if (fclose(out) != 0) ok = false;
+
+    original_size = st.st_size;
+    compressed_size = (total_bits + 7) / 8 + header_bytes;
+    count_stat(STAT_BYTES_READ, original_size);
+    count_stat(STAT_BYTES_WRITTEN, compressed_size);
+    return ok;
+}
+
+bool encode_and_pack_fano(const char* input_filename, const char* output_filename, CoderEngine coder = CODER_FANO) {
+    CodeTable codes;
+    if (!build_codes(coder, input_filename, codes)) {
+        fprintf(stderr, "Ошибка открытия файла '%s'\n", input_filename);
+        return false;
+    }
+
+    long original_size = 0;
+    long compressed_size = 0;
+    if (!pack_fano(input_filename, output_filename, codes, original_size, compressed_size)) {
+        fprintf(stderr, "Ошибка работы с файлами.\n");
+        return false;
+    }
+
+    printf("\nСжатие завершено (%s).\n", coder_engine_title(coder));
+    printf("Исходный размер: %ld байт\n", original_size);
+    printf("Сжатый размер:   %ld байт\n", compressed_size);
+    printf("Коэффициент сжатия: %.3fx\n", (double)original_size / compressed_size);
+    return true;
+}
+
+// Декодер префиксного кода: таблица на decode_table_bits бит отдаёт одним обращением
+// символ и длину его кода, таблица пар — сразу два коротких кода подряд.
+// Коды длиннее таблицы дочитываются по двоичному дереву.
+const int decode_table_bits = 12;
+
+struct DecodeTable {
+    struct Entry {
+        unsigned char symbol;
+        unsigned char length;
+    };
+    struct Pair {
+        unsigned char symbol[2];
+        unsigned char count;
+        unsigned char length;
+    };
+    struct TreeNode {
+        int child[2];
+        int symbol;
+    };
+
+    std::vector<Entry> primary;
+    std::vector<Pair> pairs;
+    std::vector<TreeNode> tree;
+};
+
+bool build_decode_table(const std::vector<PackedSymbol>& table, DecodeTable& dec) {
+    const unsigned long long table_size = 1ULL << decode_table_bits;
+    dec.primary.assign(table_size, DecodeTable::Entry{0, 0});
+    dec.tree.assign(1, DecodeTable::TreeNode{{-1, -1}, -1});
+
+    for (const PackedSymbol& s : table) {
+        if (s.length == 0 || s.length > max_code_length) return false;
+
+        int node = 0;
+        for (int i = s.length - 1; i >= 0; --i) {
+            int bit = (s.code >> i) & 1;
+            if (dec.tree[node].symbol >= 0) return false;
+            if (dec.tree[node].child[bit] < 0) {
+                dec.tree[node].child[bit] = dec.tree.size();
+                dec.tree.push_back(DecodeTable::TreeNode{{-1, -1}, -1});
+            }
+            node = dec.tree[node].child[bit];
+        }
+        if (dec.tree[node].child[0] >= 0 || dec.tree[node].child[1] >= 0) return false;
+        dec.tree[node].symbol = s.symbol;
+
+        if (s.length <= decode_table_bits) {
+            unsigned long long first = s.code << (decode_table_bits - s.length);
+            unsigned long long span = 1ULL << (decode_table_bits - s.length);
+            for (unsigned long long i = 0; i < span; ++i) {
+                dec.primary[first + i] = DecodeTable::Entry{s.symbol, s.length};
+            }
+        }
+    }
+
+    dec.pairs.resize(table_size);
+    for (unsigned long long w = 0; w < table_size; ++w) {
+        DecodeTable::Pair& p = dec.pairs[w];
+        DecodeTable::Entry first = dec.primary[w];
+        p = DecodeTable::Pair{{first.symbol, 0}, (unsigned char)(first.length ? 1 : 0), first.length};
+        if (!first.length) continue;
+
+        DecodeTable::Entry second = dec.primary[(w << first.length) & (table_size - 1)];
+        if (second.length && first.length + second.length <= decode_table_bits) {
+            p.symbol[1] = second.symbol;
+            p.count = 2;
+            p.length = first.length + second.length;
+        }
+    }
+    return true;
+}
+
+// Окно из 64 бит потока начиная с бита bitpos (старший бит — первый); верные не меньше 57.
+// За концом данных читаются нули.
+inline unsigned long long load_window(const unsigned char* data, size_t size, size_t bitpos) {
+    size_t byte = bitpos >> 3;
+    unsigned long long word = 0;
+    if (byte + 8 <= size) memcpy(&word, data + byte, 8);
+    else if (byte < size) memcpy(&word, data + byte, size - byte);
+    return __builtin_bswap64(word) << (bitpos & 7);
+}
+
+// Декодирует count символов из битового потока data начиная с bitpos в out
+bool decode_symbols(const DecodeTable& dec, const unsigned char* data, size_t size, size_t& bitpos,
+                    unsigned char* out, size_t count) {
+    const DecodeTable::Pair* pairs = dec.pairs.data();
+    const DecodeTable::Entry* primary = dec.primary.data();
+    const int shift = 64 - decode_table_bits;
+    size_t i = 0;
+
+    while (i < count) {
+        // быстрый путь: одно окно вмещает четыре пары кодов по decode_table_bits бит
+        while (count - i >= 8 && (bitpos >> 3) + 8 <= size) {
+            unsigned long long w = load_window(data, size, bitpos);
+            size_t start = bitpos;
+            int k = 0;
+            for (; k < 4; ++k) {
+                const DecodeTable::Pair p = pairs[w >> shift];
+                if (!p.count) break;
+                out[i] = p.symbol[0];
+                out[i + 1] = p.symbol[1];
+                i += p.count;
+                w <<= p.length;
+                bitpos += p.length;
+            }
+            if (k < 4 || bitpos == start) break;
+        }
+        if (i == count) break;
+
+        // одиночный символ: хвост потока или код длиннее таблицы
+        unsigned long long w = load_window(data, size, bitpos);
+        const DecodeTable::Entry e = primary[w >> shift];
+        if (e.length) {
+            out[i++] = e.symbol;
+            bitpos += e.length;
+            continue;
+        }
+        int node = 0;
+        int taken = 0;
+        while (node >= 0 && dec.tree[node].symbol < 0) {
+            if (taken == 57) {
+                w = load_window(data, size, bitpos);
+                taken = 0;
+            }
+            node = dec.tree[node].child[w >> 63];
+            w <<= 1;
+            bitpos++;
+            taken++;
+        }
+        if (node < 0 || (bitpos >> 3) > size) return false;
+        out[i++] = (unsigned char)dec.tree[node].symbol;
+    }
+    return (bitpos + 7) / 8 <= size;
+}
+
+// Распаковка файла, созданного pack_fano; original_size — размер восстановленных данных
+bool unpack_fano(const char* input_filename, const char* output_filename, unsigned long long& original_size) {
+    ScopedTimer timer(TIMER_UNPACK);
+    int fd = open(input_filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PackedHeader)) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    const unsigned char* data = static_cast<const unsigned char*>(addr);
+    size_t size = st.st_size;
+
+    PackedHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t table_bytes = header.symbol_count * sizeof(PackedSymbol);
+    bool ok = memcmp(header.magic, packed_magic, 4) == 0 && supported_packed_version(header.version) &&
+              header.symbol_count <= 256 && sizeof(header) + table_bytes <= size;
+
+    DecodeTable dec;
+    if (ok && header.original_size > 0) {
+        std::vector<PackedSymbol> table(header.symbol_count);
+        memcpy(table.data(), data + sizeof(header), table_bytes);
+        ok = build_decode_table(table, dec);
+    }
+
+    FILE* out = ok ? fopen(output_filename, "wb") : nullptr;
+    if (!out) {
+        munmap(addr, size);
+        return false;
+    }
+
+    const unsigned char* stream = data + sizeof(header) + table_bytes;
+    size_t stream_size = size - sizeof(header) - table_bytes;
+    size_t bitpos = 0;
+    std::vector<unsigned char> buffer(1 << 20);
+    unsigned long long remaining = header.original_size;
+
+    while (remaining > 0 && ok) {
+        size_t n = remaining < buffer.size() ? (size_t)remaining : buffer.size();
+        ok = decode_symbols(dec, stream, stream_size, bitpos, buffer.data(), n) &&
+             fwrite(buffer.data(), 1, n, out) == n;
+        remaining -= n;
+    }
+
+    munmap(addr, size);
+    if (fclose(out) != 0) ok = false;
+    original_size = header.original_size;
+    count_stat(STAT_BYTES_READ, st.st_size);
+    count_stat(STAT_BYTES_WRITTEN, original_size);
+    return ok;
+}
+
+bool files_equal(const char* a, const char* b) {
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    bool equal = fa && fb;
+    std::vector<char> ba(1 << 16), bb(1 << 16);
+    while (equal) {
+        size_t na = fread(ba.data(), 1, ba.size(), fa);
+        size_t nb = fread(bb.data(), 1, bb.size(), fb);
+        if (na != nb || memcmp(ba.data(), bb.data(), na) != 0) equal = false;
+        if (na == 0) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return equal;
+}
+
+void decode_and_unpack_fano(const char* input_filename, const char* output_filename) {
+    unsigned long long original_size = 0;
+    if (!unpack_fano(input_filename, output_filename, original_size)) {
+        printf("Ошибка распаковки файла '%s'\n", input_filename);
+        return;
+    }
+    printf("\nРаспаковка завершена.\n");
+    printf("Восстановлено: %llu байт в '%s'\n", original_size, output_filename);
+}
+
+// Блочный архив: коды Фано общие для всего файла, но поток разбит на блоки
+// по block_records записей. Каждый блок кодируется независимо и начинается
+// с границы байта, поэтому блоки сжимаются параллельно, а по индексу смещений
+// распаковывается любой диапазон записей без декодирования остального файла.
+// Формат: PackedHeader (магия FANB), таблица кодов, BlockIndexHeader, BlockEntry[], блоки.
+const char block_magic[4] = {'F', 'A', 'N', 'B'};
+const unsigned default_block_records = 4096;
+
+struct BlockIndexHeader {
+    unsigned block_records;
+    unsigned reserved;
+    unsigned long long block_count;
+};
+
+struct BlockEntry {
+    unsigned long long offset;  // от начала области блоков
+    unsigned long long bytes;
+};
+
+// Кодирует len байт в out; размер буфера заранее вычисляется по длинам кодов
+void encode_block(const CodeTable& codes, const unsigned char* data, size_t len, std::vector<unsigned char>& out) {
+    unsigned long long bits = 0;
+    for (size_t i = 0; i < len; ++i) bits += codes.length[data[i]];
+    out.resize((bits + 7) / 8 + 8);
+    BitWriter writer(out.data());
+    for (size_t i = 0; i < len; ++i) writer.put(codes.code[data[i]], codes.length[data[i]]);
+    writer.finish();
+    out.resize(writer.pos);
+}
+
+bool pack_fano_blocks(const char* input_filename, const char* output_filename, const CodeTable& codes,
+                      unsigned block_records, unsigned threads, long& original_size, long& compressed_size) {
+    ScopedTimer timer(TIMER_PACK);
+    int fd = open(input_filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    const unsigned char* data = nullptr;
+    if (ok && st.st_size > 0) {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) ok = false;
+        else data = static_cast<const unsigned char*>(addr);
+    }
+    close(fd);
+    FILE* out = ok ? fopen(output_filename, "wb") : nullptr;
+    if (!out) {
+        if (data) munmap(const_cast<unsigned char*>(data), st.st_size);
+        return false;
+    }
+    if (data) madvise(const_cast<unsigned char*>(data), st.st_size, MADV_SEQUENTIAL);
+
+    size_t size = st.st_size;
+    if (block_records == 0) block_records = default_block_records;
+    size_t block_bytes = (size_t)block_records * sizeof(Record);
+
+    BlockIndexHeader index = {};
+    index.block_records = block_records;
+    index.block_count = (size + block_bytes - 1) / block_bytes;
+    std::vector<BlockEntry> entries(index.block_count);
+
+    size_t header_bytes = 0;
+    ok = write_packed_header(out, codes, size, header_bytes, block_magic) &&
+         fwrite(&index, sizeof(index), 1, out) == 1 &&
+         fwrite(entries.data(), sizeof(BlockEntry), entries.size(), out) == entries.size();
+    long index_pos = header_bytes + sizeof(index);
+
+    // блоки кодируются партиями по несколько на поток и сразу пишутся по порядку,
+    // так что в памяти одновременно не больше одной партии сжатых данных
+    TaskPool pool(threads);
+    std::vector<std::vector<unsigned char>> encoded(pool.size() * 4);
+    unsigned long long offset = 0;
+
+    for (size_t first = 0; ok && first < entries.size(); first += encoded.size()) {
+        size_t batch = std::min(encoded.size(), entries.size() - first);
+        TaskGroup group;
+        for (size_t j = 0; j < batch; ++j) {
+            size_t start = (first + j) * block_bytes;
+            size_t len = std::min(block_bytes, size - start);
+            std::vector<unsigned char>* dst = &encoded[j];
+            pool.spawn(group, [&codes, data, start, len, dst] {
+                encode_block(codes, data + start, len, *dst);
+            });
+        }
+        pool.wait(group);
+
+        for (size_t j = 0; j < batch && ok; ++j) {
+            entries[first + j].offset = offset;
+            entries[first + j].bytes = encoded[j].size();
+            offset += encoded[j].size();
+            ok = fwrite(encoded[j].data(), 1, encoded[j].size(), out) == encoded[j].size();
+        }
+    }
+
+    if (ok && !entries.empty()) {
+        ok = fseek(out, index_pos, SEEK_SET) == 0 &&
+             fwrite(entries.data(), sizeof(BlockEntry), entries.size(), out) == entries.size();
+    }
+
+    if (data) munmap(const_cast<unsigned char*>(data), size);
+    if (fclose(out) != 0) ok = false;
+
+    original_size = size;
+    compressed_size = index_pos + entries.size() * sizeof(BlockEntry) + offset;
+    return ok;
+}
+
+bool encode_and_pack_fano_blocks(const char* input_filename, const char* output_filename,
+                                 unsigned block_records, unsigned threads, CoderEngine coder = CODER_FANO) {
+    CodeTable codes;
+    if (!build_codes(coder, input_filename, codes)) {
+        fprintf(stderr, "Ошибка открытия файла '%s'\n", input_filename);
+        return false;
+    }
+
+    long original_size = 0;
+    long compressed_size = 0;
+    if (!pack_fano_blocks(input_filename, output_filename, codes, block_records, threads,
+                          original_size, compressed_size)) {
+        fprintf(stderr, "Ошибка работы с файлами.\n");
+        return false;
+    }
+
+    printf("\nБлочное сжатие завершено (%s, %u записей в блоке).\n", coder_engine_title(coder), block_records);
+    printf("Исходный размер: %ld байт\n", original_size);
+    printf("Сжатый размер:   %ld байт\n", compressed_size);
+    printf("Коэффициент сжатия: %.3fx\n", (double)original_size / compressed_size);
+    return true;
+}
+
+// Открытый блочный архив: файл отображён в память, индекс и таблица декодирования готовы
+struct BlockArchive {
+    void* addr;
+    size_t size;
+    PackedHeader header;
+    BlockIndexHeader index;
+    std::vector<BlockEntry> entries;
+    const unsigned char* blocks;
+    size_t blocks_size;
+    DecodeTable dec;
+};
+
+void close_block_archive(BlockArchive& archive) {
+    if (archive.addr) munmap(archive.addr, archive.size);
+    archive.addr = nullptr;
+}
+
+bool open_block_archive(const char* filename, BlockArchive& archive) {
+    archive.addr = nullptr;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PackedHeader) + sizeof(BlockIndexHeader)) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    archive.addr = addr;
+    archive.size = st.st_size;
+    const unsigned char* data = static_cast<const unsigned char*>(addr);
+
+    PackedHeader& header = archive.header;
+    memcpy(&header, data, sizeof(header));
+    size_t pos = sizeof(header) + header.symbol_count * sizeof(PackedSymbol);
+    bool ok = memcmp(header.magic, block_magic, 4) == 0 && supported_packed_version(header.version) &&
+              header.symbol_count <= 256 && pos + sizeof(BlockIndexHeader) <= archive.size;
+
+    if (ok) {
+        memcpy(&archive.index, data + pos, sizeof(BlockIndexHeader));
+        pos += sizeof(BlockIndexHeader);
+        unsigned long long block_bytes = (unsigned long long)archive.index.block_records * sizeof(Record);
+        ok = block_bytes > 0 &&
+             archive.index.block_count == (header.original_size + block_bytes - 1) / block_bytes &&
+             archive.index.block_count <= (archive.size - pos) / sizeof(BlockEntry);
+    }
+    if (ok) {
+        archive.entries.resize(archive.index.block_count);
+        memcpy(archive.entries.data(), data + pos, archive.entries.size() * sizeof(BlockEntry));
+        pos += archive.entries.size() * sizeof(BlockEntry);
+        archive.blocks = data + pos;
+        archive.blocks_size = archive.size - pos;
+        for (const BlockEntry& e : archive.entries) {
+            if (e.offset > archive.blocks_size || e.bytes > archive.blocks_size - e.offset) ok = false;
+        }
+    }
+    if (ok && header.original_size > 0) {
+        std::vector<PackedSymbol> table(header.symbol_count);
+        memcpy(table.data(), data + sizeof(header), table.size() * sizeof(PackedSymbol));
+        ok = build_decode_table(table, archive.dec);
+    }
+
+    if (!ok) close_block_archive(archive);
+    return ok;
+}
+
+// Распаковывает блок b в out; возвращает число восстановленных байт или 0 при ошибке
+size_t decode_block(const BlockArchive& archive, size_t b, unsigned char* out) {
+    size_t block_bytes = (size_t)archive.index.block_records * sizeof(Record);
+    size_t start = b * block_bytes;
+    size_t n = std::min<unsigned long long>(block_bytes, archive.header.original_size - start);
+    const BlockEntry& e = archive.entries[b];
+    size_t bitpos = 0;
+    if (!decode_symbols(archive.dec, archive.blocks + e.offset, e.bytes, bitpos, out, n)) return 0;
+    return n;
+}
+
+// Распаковка записей [first_record, first_record + record_count) блочного архива.
+// Декодируются только блоки, пересекающиеся с диапазоном; диапазон за концом архива обрезается.
+bool unpack_fano_range(const char* input_filename, const char* output_filename,
+                       unsigned long long first_record, unsigned long long record_count,
+                       unsigned threads, unsigned long long& written) {
+    ScopedTimer timer(TIMER_UNPACK);
+    written = 0;
+    BlockArchive archive;
+    if (!open_block_archive(input_filename, archive)) return false;
+
+    unsigned long long total = archive.header.original_size;
+    unsigned long long begin = std::min<unsigned long long>(first_record * sizeof(Record), total);
+    unsigned long long available = (total - begin + sizeof(Record) - 1) / sizeof(Record);
+    unsigned long long end = record_count < available ? begin + record_count * sizeof(Record) : total;
+
+    FILE* out = fopen(output_filename, "wb");
+    if (!out) {
+        close_block_archive(archive);
+        return false;
+    }
+
+    bool ok = true;
+    size_t block_bytes = (size_t)archive.index.block_records * sizeof(Record);
+    if (begin < end) {
+        size_t first_block = begin / block_bytes;
+        size_t last_block = (end - 1) / block_bytes;
+        if (last_block > first_block) madvise(archive.addr, archive.size, MADV_SEQUENTIAL);
+
+        TaskPool pool(std::min<size_t>(threads, last_block - first_block + 1));
+        size_t slots = pool.size() * 4;
+        std::vector<unsigned char> buffer(std::min(slots, last_block - first_block + 1) * block_bytes);
+        std::vector<size_t> decoded(slots);
+
+        for (size_t first = first_block; ok && first <= last_block; first += slots) {
+            size_t batch = std::min(slots, last_block - first + 1);
+            TaskGroup group;
+            for (size_t j = 0; j < batch; ++j) {
+                unsigned char* dst = buffer.data() + j * block_bytes;
+                size_t* count = &decoded[j];
+                size_t b = first + j;
+                pool.spawn(group, [&archive, b, dst, count] {
+                    *count = decode_block(archive, b, dst);
+                });
+            }
+            pool.wait(group);
+
+            for (size_t j = 0; j < batch && ok; ++j) {
+                unsigned long long start = (unsigned long long)(first + j) * block_bytes;
+                unsigned long long from = std::max(begin, start);
+                unsigned long long to = std::min<unsigned long long>(end, start + decoded[j]);
+                ok = decoded[j] > 0 && from <= to;
+                if (ok) {
+                    size_t n = to - from;
+                    ok = fwrite(buffer.data() + j * block_bytes + (from - start), 1, n, out) == n;
+                    written += n;
+                }
+            }
+        }
+    }
+
+    close_block_archive(archive);
+    if (fclose(out) != 0) ok = false;
+    return ok;
+}
+
+// Определяет формат архива по магии в начале файла
+bool has_magic(const char* filename, const char expected[4]) {
+    char magic[4] = {};
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, expected, 4) == 0;
+    fclose(file);
+    return ok;
+}
+
+size_t file_size(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    return (size_t)st.st_size;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Сравнение кодеров на одном входе: энтропия, средняя длина кода, размер
+// и скорость сжатия/распаковки в памяти (без файлового ввода-вывода)
+bool compare_coders(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return false;
+    }
+    std::vector<unsigned char> data(st.st_size);
+    bool ok = data.empty() || fread(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    if (!ok) return false;
+
+    unsigned long long freq[256] = {};
+    for (unsigned char ch : data) freq[ch]++;
+    double entropy = 0.0;
+    for (int ch = 0; ch < 256; ++ch) {
+        if (!freq[ch]) continue;
+        double p = (double)freq[ch] / data.size();
+        entropy -= p * std::log2(p);
+    }
+
+    printf("\nФайл '%s': %zu байт, энтропия H = %.6f бит/символ\n", filename, data.size(), entropy);
+    printf("+---------+----------+----------+------------+------------+------------+\n");
+    printf("| Кодер   | L, бит   | L - H    | Сжатый     | Сжатие     | Распаковка |\n");
+    printf("+---------+----------+----------+------------+------------+------------+\n");
+
+    std::vector<unsigned char> packed, unpacked(io_block_size);
+    packed.reserve(data.size());
+    double mb = data.size() / (1024.0 * 1024.0);
+    for (CoderEngine coder : coder_engines) {
+        CodeTable codes;
+        build_codes(coder, freq, data.size(), codes);
+
+        unsigned long long bits = 0;
+        for (int ch = 0; ch < 256; ++ch) bits += freq[ch] * codes.length[ch];
+        double avg_len = data.empty() ? 0.0 : (double)bits / data.size();
+
+        // кодирование и декодирование блоками по io_block_size, как в блочном архиве
+        std::vector<size_t> offsets;
+        std::vector<unsigned char> block;
+        auto start = std::chrono::steady_clock::now();
+        packed.clear();
+        for (size_t pos = 0; pos < data.size(); pos += io_block_size) {
+            encode_block(codes, data.data() + pos, std::min(io_block_size, data.size() - pos), block);
+            offsets.push_back(packed.size());
+            packed.insert(packed.end(), block.begin(), block.end());
+        }
+        offsets.push_back(packed.size());
+        double encode_ms = elapsed_ms(start);
+
+        std::vector<PackedSymbol> table;
+        DecodeTable dec;
+        ok = packed_symbols(codes, table) && (data.empty() || build_decode_table(table, dec));
+        start = std::chrono::steady_clock::now();
+        for (size_t b = 0; ok && b + 1 < offsets.size(); ++b) {
+            size_t pos = b * io_block_size;
+            size_t n = std::min(io_block_size, data.size() - pos);
+            size_t bitpos = 0;
+            ok = decode_symbols(dec, packed.data() + offsets[b], offsets[b + 1] - offsets[b], bitpos,
+                                unpacked.data(), n) &&
+                 memcmp(unpacked.data(), data.data() + pos, n) == 0;
+        }
+        double decode_ms = elapsed_ms(start);
+        if (!ok) {
+            printf("Ошибка: %s не восстановил исходные данные\n", coder_engine_title(coder));
+            return false;
+        }
+
+        // название в UTF-8: ширина столбца считается в символах, а не в байтах
+        std::string title = coder_engine_title(coder);
+        size_t width = 0;
+        for (unsigned char c : title) width += (c & 0xC0) != 0x80;
+        title.append(width < 7 ? 7 - width : 0, ' ');
+
+        printf("| %s | %8.4f | %8.4f | %10zu | %6.1f МБ/с | %6.1f МБ/с |\n",
+               title.c_str(), avg_len, avg_len - entropy, packed.size(),
+               encode_ms > 0 ? mb * 1000.0 / encode_ms : 0.0,
+               decode_ms > 0 ? mb * 1000.0 / decode_ms : 0.0);
+    }
+    printf("+---------+----------+----------+------------+------------+------------+\n");
+    return true;
+}
+
+// Колоночный архив: записи разбираются на поля, каждое поле — отдельная колонка,
+// сжимаемая своим префиксным кодом. Улицы заменяются номерами в словаре,
+// даты и дом/квартира хранятся числами. Колонка — это вложенный поток в формате
+// pack (PackedHeader, таблица кодов, биты), поэтому фильтр по году или улице
+// распаковывает только свои колонки. Записи, которые не восстанавливаются из
+// колонок побайтово (нестандартное заполнение, дата не в виде дд-мм-гг), целиком
+// хранятся в колонках исключений, а в обычных колонках на их месте стоят нули.
+const char column_magic[4] = {'F', 'A', 'N', 'C'};
+const unsigned int column_version = 1;
+
+enum ColumnId {
+    COL_FIO_LENGTH,      // длина ФИО без пробелов-заполнителей, 1 байт
+    COL_FIO_TEXT,        // ФИО всех записей подряд
+    COL_STREET_DICT,     // словарь: поля street по 18 байт
+    COL_STREET,          // номер улицы в словаре
+    COL_YEAR,            // дата числами по 1 байту
+    COL_MONTH,
+    COL_DAY,
+    COL_HOUSE,
+    COL_FLAT,
+    COL_EXCEPTION_INDEX, // номера записей-исключений, 4 байта
+    COL_EXCEPTION_DATA,  // сами записи-исключения
+    COL_TAIL,            // байты после последней целой записи
+    column_count
+};
+
+const char* const column_names[column_count] = {
+    "fio_length", "fio_text", "street_dict", "street", "year", "month", "day",
+    "house", "flat", "exception_index", "exception_data", "tail"
+};
+
+struct ColumnarHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned long long record_count;
+    unsigned int column_count;
+    unsigned int coder;
+};
+
+struct ColumnEntry {
+    unsigned int id;
+    unsigned int width;  // байт на значение для числовых колонок
+    unsigned long long offset;  // от начала файла
+    unsigned long long bytes;
+};
+
+// Колонка в формате pack в памяти: заголовок, таблица кодов, битовый поток
+bool pack_column(const std::vector<unsigned char>& raw, CoderEngine coder, std::vector<unsigned char>& out) {
+    unsigned long long freq[256] = {};
+    for (unsigned char ch : raw) freq[ch]++;
+    CodeTable codes;
+    build_codes(coder, freq, raw.size(), codes);
+
+    std::vector<PackedSymbol> table;
+    if (!packed_symbols(codes, table)) return false;
+    PackedHeader header = {};
+    memcpy(header.magic, packed_magic, 4);
+    header.version = packed_version;
+    header.original_size = raw.size();
+    header.symbol_count = table.size();
+    header.coder = coder;
+
+    std::vector<unsigned char> stream;
+    encode_block(codes, raw.data(), raw.size(), stream);
+    size_t table_bytes = table.size() * sizeof(PackedSymbol);
+    out.resize(sizeof(header) + table_bytes + stream.size());
+    memcpy(out.data(), &header, sizeof(header));
+    if (table_bytes) memcpy(out.data() + sizeof(header), table.data(), table_bytes);
+    if (!stream.empty()) memcpy(out.data() + sizeof(header) + table_bytes, stream.data(), stream.size());
+    return true;
+}
+
+bool unpack_column(const unsigned char* data, size_t size, std::vector<unsigned char>& raw) {
+    PackedHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    size_t table_bytes = header.symbol_count * sizeof(PackedSymbol);
+    if (memcmp(header.magic, packed_magic, 4) != 0 || !supported_packed_version(header.version) ||
+        header.symbol_count > 256 || sizeof(header) + table_bytes > size) {
+        return false;
+    }
+
+    raw.resize(header.original_size);
+    if (raw.empty()) return true;
+    std::vector<PackedSymbol> table(header.symbol_count);
+    memcpy(table.data(), data + sizeof(header), table_bytes);
+    DecodeTable dec;
+    if (!build_decode_table(table, dec)) return false;
+    size_t bitpos = 0;
+    return decode_symbols(dec, data + sizeof(header) + table_bytes, size - sizeof(header) - table_bytes,
+                          bitpos, raw.data(), raw.size());
+}
+
+// Дата дд-мм-гг в виде трёх чисел; нецифровые символы дают значения,
+// которые не восстановят исходную дату, и запись уйдёт в исключения
+int date_part(const char* p) {
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+void put_date_part(char* p, int value) {
+    p[0] = '0' + value / 10;
+    p[1] = '0' + value % 10;
+}
+
+void put_value(std::vector<unsigned char>& column, unsigned value, unsigned width) {
+    for (unsigned b = 0; b < width; ++b) column.push_back((unsigned char)(value >> (8 * b)));
+}
+
+unsigned get_value(const std::vector<unsigned char>& column, size_t i, unsigned width) {
+    unsigned value = 0;
+    for (unsigned b = 0; b < width; ++b) value |= (unsigned)column[i * width + b] << (8 * b);
+    return value;
+}
+
+// Сборка записи из значений колонок
+void assemble_record(Record& r, const unsigned char* fio, size_t fio_length, const char* street,
+                     int year, int month, int day, unsigned short house, unsigned short flat) {
+    memset(r.fio, ' ', sizeof(r.fio) - 1);
+    memcpy(r.fio, fio, fio_length);
+    r.fio[sizeof(r.fio) - 1] = '\0';
+    memcpy(r.street, street, sizeof(r.street));
+    r.house = (short)house;
+    r.flat = (short)flat;
+    put_date_part(r.settleDate, day);
+    r.settleDate[2] = '-';
+    put_date_part(r.settleDate + 3, month);
+    r.settleDate[5] = '-';
+    put_date_part(r.settleDate + 6, year);
+    r.settleDate[8] = ' ';
+    r.settleDate[9] = '\0';
+}
+
+struct ColumnSet {
+    std::vector<unsigned char> data[column_count];
+    unsigned width[column_count];
+};
+
+// Разбор файла на колонки; exceptions — число записей, сохранённых целиком
+void split_columns(const unsigned char* input, size_t size, ColumnSet& cols, size_t& exceptions) {
+    size_t count = size / sizeof(Record);
+    std::map<std::string, unsigned> street_ids;
+    std::vector<unsigned short> streets, houses, flats;
+    streets.reserve(count);
+    houses.reserve(count);
+    flats.reserve(count);
+    for (unsigned c = 0; c < column_count; ++c) cols.width[c] = 1;
+    exceptions = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        Record r;
+        memcpy(&r, input + i * sizeof(Record), sizeof(Record));
+
+        size_t fio_length = last_non_space(r.fio, sizeof(r.fio) - 1) + 1;
+        std::string street(r.street, sizeof(r.street));
+        auto it = street_ids.find(street);
+        if (it == street_ids.end() && street_ids.size() < 65536) {
+            it = street_ids.emplace(street, street_ids.size()).first;
+            cols.data[COL_STREET_DICT].insert(cols.data[COL_STREET_DICT].end(), street.begin(), street.end());
+        }
+        int year = date_part(r.settleDate + 6);
+        int month = date_part(r.settleDate + 3);
+        int day = date_part(r.settleDate);
+
+        Record check;
+        bool exact = it != street_ids.end() && year >= 0 && year < 100 && month >= 0 && month < 100 &&
+                     day >= 0 && day < 100;
+        if (exact) {
+            assemble_record(check, (const unsigned char*)r.fio, fio_length, r.street, year, month, day,
+                            r.house, r.flat);
+            exact = memcmp(&check, &r, sizeof(Record)) == 0;
+        }
+
+        if (!exact) {
+            put_value(cols.data[COL_EXCEPTION_INDEX], (unsigned)i, 4);
+            cols.data[COL_EXCEPTION_DATA].insert(cols.data[COL_EXCEPTION_DATA].end(),
+                                                 input + i * sizeof(Record), input + (i + 1) * sizeof(Record));
+            ++exceptions;
+            fio_length = 0;
+            year = month = day = 0;
+        } else {
+            cols.data[COL_FIO_TEXT].insert(cols.data[COL_FIO_TEXT].end(), r.fio, r.fio + fio_length);
+        }
+        cols.data[COL_FIO_LENGTH].push_back((unsigned char)fio_length);
+        cols.data[COL_YEAR].push_back((unsigned char)year);
+        cols.data[COL_MONTH].push_back((unsigned char)month);
+        cols.data[COL_DAY].push_back((unsigned char)day);
+        streets.push_back(exact ? it->second : 0);
+        houses.push_back(exact ? (unsigned short)r.house : 0);
+        flats.push_back(exact ? (unsigned short)r.flat : 0);
+    }
+    cols.width[COL_EXCEPTION_INDEX] = 4;
+    cols.width[COL_STREET_DICT] = sizeof(Record::street);
+    cols.width[COL_EXCEPTION_DATA] = sizeof(Record);
+    cols.data[COL_TAIL].assign(input + count * sizeof(Record), input + size);
+
+    // числовые колонки занимают 1 байт на значение, если все значения в него помещаются
+    const std::pair<ColumnId, std::vector<unsigned short>*> numeric[] = {
+        {COL_STREET, &streets}, {COL_HOUSE, &houses}, {COL_FLAT, &flats}
+    };
+    for (const auto& [id, values] : numeric) {
+        unsigned width = 1;
+        for (unsigned short v : *values) {
+            if (v > 255) width = 2;
+        }
+        cols.width[id] = width;
+        cols.data[id].reserve(values->size() * width);
+        for (unsigned short v : *values) put_value(cols.data[id], v, width);
+    }
+}
+
+// Упаковка файла записей в колоночный архив; колонки сжимаются параллельно
+bool pack_columns(const char* input_filename, const char* output_filename, CoderEngine coder, unsigned threads,
+                  std::vector<ColumnEntry>& entries, size_t& exceptions) {
+    ScopedTimer timer(TIMER_PACK);
+    int fd = open(input_filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    const unsigned char* input = nullptr;
+    if (size > 0) {
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) input = static_cast<const unsigned char*>(addr);
+    }
+    close(fd);
+    if (size > 0 && !input) return false;
+    if (input) madvise(const_cast<unsigned char*>(input), size, MADV_SEQUENTIAL);
+
+    ColumnSet cols;
+    split_columns(input, size, cols, exceptions);
+    if (input) munmap(const_cast<unsigned char*>(input), size);
+
+    std::vector<unsigned char> packed[column_count];
+    std::atomic<bool> ok{true};
+    {
+        TaskPool pool(threads);
+        TaskGroup group;
+        for (unsigned c = 0; c < column_count; ++c) {
+            pool.spawn(group, [&cols, &packed, &ok, c, coder] {
+                if (!pack_column(cols.data[c], coder, packed[c])) ok = false;
+                std::vector<unsigned char>().swap(cols.data[c]);
+            });
+        }
+        pool.wait(group);
+    }
+
+    ColumnarHeader header = {};
+    memcpy(header.magic, column_magic, 4);
+    header.version = column_version;
+    header.record_count = size / sizeof(Record);
+    header.column_count = column_count;
+    header.coder = coder;
+
+    entries.assign(column_count, ColumnEntry());
+    unsigned long long offset = sizeof(header) + column_count * sizeof(ColumnEntry);
+    for (unsigned c = 0; c < column_count; ++c) {
+        entries[c].id = c;
+        entries[c].width = cols.width[c];
+        entries[c].offset = offset;
+        entries[c].bytes = packed[c].size();
+        offset += packed[c].size();
+    }
+
+    FILE* out = ok ? fopen(output_filename, "wb") : nullptr;
+    if (!out) return false;
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                   fwrite(entries.data(), sizeof(ColumnEntry), entries.size(), out) == entries.size();
+    for (unsigned c = 0; c < column_count && written; ++c) {
+        written = fwrite(packed[c].data(), 1, packed[c].size(), out) == packed[c].size();
+    }
+    if (fclose(out) != 0) written = false;
+    return written;
+}
+
+bool encode_and_pack_columns(const char* input_filename, const char* output_filename,
+                             CoderEngine coder, unsigned threads) {
+    std::vector<ColumnEntry> entries;
+    size_t exceptions = 0;
+    if (!pack_columns(input_filename, output_filename, coder, threads, entries, exceptions)) {
+        fprintf(stderr, "Ошибка работы с файлами.\n");
+        return false;
+    }
+
+    unsigned long long compressed_size = sizeof(ColumnarHeader) + entries.size() * sizeof(ColumnEntry);
+    printf("\nКолоночное сжатие завершено (%s).\n", coder_engine_title(coder));
+    printf("+-----------------+--------------+\n");
+    printf("| Колонка         | Сжато, байт  |\n");
+    printf("+-----------------+--------------+\n");
+    for (const ColumnEntry& e : entries) {
+        printf("| %-15s | %12llu |\n", column_names[e.id], e.bytes);
+        compressed_size += e.bytes;
+    }
+    printf("+-----------------+--------------+\n");
+
+    size_t original_size = file_size(input_filename);
+    printf("Записей-исключений: %zu\n", exceptions);
+    printf("Исходный размер: %zu байт\n", original_size);
+    printf("Сжатый размер:   %llu байт\n", compressed_size);
+    printf("Коэффициент сжатия: %.3fx\n", (double)original_size / compressed_size);
+    return true;
+}
+
+// Открытый колоночный архив; колонки распаковываются по требованию
+struct ColumnArchive {
+    void* addr;
+    size_t size;
+    ColumnarHeader header;
+    ColumnEntry entries[column_count];
+};
+
+void close_column_archive(ColumnArchive& archive) {
+    if (archive.addr) munmap(archive.addr, archive.size);
+    archive.addr = nullptr;
+}
+
+bool open_column_archive(const char* filename, ColumnArchive& archive) {
+    archive.addr = nullptr;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ColumnarHeader) + sizeof(archive.entries)) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    archive.addr = addr;
+    archive.size = st.st_size;
+
+    const unsigned char* data = static_cast<const unsigned char*>(addr);
+    memcpy(&archive.header, data, sizeof(archive.header));
+    memcpy(archive.entries, data + sizeof(archive.header), sizeof(archive.entries));
+    bool ok = memcmp(archive.header.magic, column_magic, 4) == 0 && archive.header.version == column_version &&
+              archive.header.column_count == column_count;
+    for (unsigned c = 0; c < column_count && ok; ++c) {
+        const ColumnEntry& e = archive.entries[c];
+        ok = e.id == c && e.width >= 1 && e.width <= sizeof(Record) &&
+             e.offset <= archive.size && e.bytes <= archive.size - e.offset;
+    }
+    if (!ok) close_column_archive(archive);
+    return ok;
+}
+
+// Распаковывает колонку и проверяет, что в ней по значению на запись (или на элемент словаря)
+bool load_column(const ColumnArchive& archive, ColumnId id, std::vector<unsigned char>& raw) {
+    const ColumnEntry& e = archive.entries[id];
+    const unsigned char* data = static_cast<const unsigned char*>(archive.addr);
+    if (!unpack_column(data + e.offset, e.bytes, raw)) return false;
+    if (raw.size() % e.width != 0) return false;
+    bool per_record = id != COL_FIO_TEXT && id != COL_STREET_DICT && id != COL_EXCEPTION_INDEX &&
+                      id != COL_EXCEPTION_DATA && id != COL_TAIL;
+    return !per_record || raw.size() / e.width == archive.header.record_count;
+}
+
+// Исключения: номер записи и сама запись
+bool load_exceptions(const ColumnArchive& archive, std::vector<unsigned>& index, std::vector<unsigned char>& data) {
+    std::vector<unsigned char> raw;
+    if (!load_column(archive, COL_EXCEPTION_INDEX, raw) || !load_column(archive, COL_EXCEPTION_DATA, data)) {
+        return false;
+    }
+    index.resize(raw.size() / 4);
+    for (size_t i = 0; i < index.size(); ++i) index[i] = get_value(raw, i, 4);
+    if (data.size() != index.size() * sizeof(Record)) return false;
+    for (unsigned i : index) {
+        if (i >= archive.header.record_count) return false;
+    }
+    return true;
+}
+
+bool unpack_columns(const char* input_filename, const char* output_filename, unsigned long long& original_size) {
+    ScopedTimer timer(TIMER_UNPACK);
+    ColumnArchive archive;
+    if (!open_column_archive(input_filename, archive)) return false;
+
+    ColumnSet cols;
+    bool ok = true;
+    for (unsigned c = 0; c < column_count && ok; ++c) {
+        cols.width[c] = archive.entries[c].width;
+        ok = load_column(archive, (ColumnId)c, cols.data[c]);
+    }
+    std::vector<unsigned> exception_index;
+    std::vector<unsigned char> exception_data;
+    ok = ok && load_exceptions(archive, exception_index, exception_data);
+    size_t count = archive.header.record_count;
+    size_t street_count = cols.data[COL_STREET_DICT].size() / sizeof(Record::street);
+    close_column_archive(archive);
+
+    std::vector<Record> records(ok ? count : 0);
+    size_t fio_pos = 0;
+    for (size_t i = 0; i < count && ok; ++i) {
+        size_t fio_length = cols.data[COL_FIO_LENGTH][i];
+        unsigned street = get_value(cols.data[COL_STREET], i, cols.width[COL_STREET]);
+        ok = fio_length < sizeof(Record::fio) && fio_pos + fio_length <= cols.data[COL_FIO_TEXT].size() &&
+             (street < street_count || fio_length == 0);
+        if (!ok) break;
+        assemble_record(records[i], cols.data[COL_FIO_TEXT].data() + fio_pos, fio_length,
+                        street < street_count
+                            ? (const char*)cols.data[COL_STREET_DICT].data() + street * sizeof(Record::street)
+                            : "                 ",
+                        cols.data[COL_YEAR][i], cols.data[COL_MONTH][i], cols.data[COL_DAY][i],
+                        get_value(cols.data[COL_HOUSE], i, cols.width[COL_HOUSE]),
+                        get_value(cols.data[COL_FLAT], i, cols.width[COL_FLAT]));
+        fio_pos += fio_length;
+    }
+    for (size_t k = 0; k < exception_index.size() && ok; ++k) {
+        memcpy(&records[exception_index[k]], exception_data.data() + k * sizeof(Record), sizeof(Record));
+    }
+
+    FILE* out = ok ? fopen(output_filename, "wb") : nullptr;
+    if (!out) return false;
+    ok = fwrite(records.data(), sizeof(Record), records.size(), out) == records.size() &&
+         fwrite(cols.data[COL_TAIL].data(), 1, cols.data[COL_TAIL].size(), out) == cols.data[COL_TAIL].size();
+    if (fclose(out) != 0) ok = false;
+    original_size = records.size() * sizeof(Record) + cols.data[COL_TAIL].size();
+    return ok;
+}
+
+// Улица без пробелов-заполнителей и завершающего нуля
+std::string street_text(const char* street) {
+    size_t n = strnlen(street, sizeof(Record::street));
+    return std::string(street, last_non_space(street, (int)n) + 1);
+}
+
+// Номера записей с заданным годом (year < 0 — любой) и улицей (nullptr — любая, в UTF-8).
+// Распаковываются только колонки года, улиц со словарём и исключений.
+bool filter_columns(const char* filename, int year, const char* street, std::vector<size_t>& matches) {
+    matches.clear();
+    ColumnArchive archive;
+    if (!open_column_archive(filename, archive)) return false;
+
+    size_t count = archive.header.record_count;
+    std::vector<unsigned char> years, streets, dict;
+    std::vector<unsigned> exception_index;
+    std::vector<unsigned char> exception_data;
+    unsigned street_width = archive.entries[COL_STREET].width;
+    bool ok = load_exceptions(archive, exception_index, exception_data) &&
+              (year < 0 || load_column(archive, COL_YEAR, years)) &&
+              (!street || (load_column(archive, COL_STREET, streets) && load_column(archive, COL_STREET_DICT, dict)));
+    close_column_archive(archive);
+    if (!ok) return false;
+
+    std::string wanted = street ? utf8_to_cp866(street) : std::string();
+    std::vector<char> street_match(dict.size() / sizeof(Record::street));
+    for (size_t s = 0; s < street_match.size(); ++s) {
+        street_match[s] = street_text((const char*)dict.data() + s * sizeof(Record::street)) == wanted;
+    }
+
+    std::vector<char> is_exception(count);
+    for (unsigned i : exception_index) is_exception[i] = 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (is_exception[i]) continue;
+        if (year >= 0 && years[i] != year) continue;
+        if (street) {
+            unsigned s = get_value(streets, i, street_width);
+            if (s >= street_match.size() || !street_match[s]) continue;
+        }
+        matches.push_back(i);
+    }
+
+    // исключения проверяются по исходным записям и вставляются на свои места
+    size_t before = matches.size();
+    for (size_t k = 0; k < exception_index.size(); ++k) {
+        const Record* r = reinterpret_cast<const Record*>(exception_data.data() + k * sizeof(Record));
+        if (year >= 0 && date_part(r->settleDate + 6) != year) continue;
+        if (street && street_text(r->street) != wanted) continue;
+        matches.push_back(exception_index[k]);
+    }
+    if (matches.size() > before) std::sort(matches.begin(), matches.end());
+    return true;
+}
+
+// База в памяти: связный список либо отображённый файл с индексом поверх него
+struct Database {
+    bool use_mmap;
+    ListNode* head;
+    MappedBase base;
+    std::vector<Record*> index;
+    DateDirectory dates;  // строится по отсортированному индексу
+    size_t count;
+    bool sorted;
+    std::deque<Record> appended;  // добавленные записи отображённой базы
+    std::vector<Record*> delta;   // добавленные, ещё не слитые с индексом, в порядке добавления
+};
+
+bool load_database(const char* filename, bool use_mmap, Database& db) {
+    ScopedTimer timer(TIMER_LOAD);
+    db.use_mmap = use_mmap;
+    db.head = nullptr;
+    db.base = MappedBase();
+    db.index.clear();
+    db.dates.offsets.clear();
+    db.count = 0;
+    db.sorted = false;
+    db.appended.clear();
+    db.delta.clear();
+
+    if (use_mmap) {
+        if (!map_base(filename, db.base)) return false;
+        db.index = build_index(db.base.records, db.base.count);
+        db.count = db.base.count;
+        return true;
+    }
+
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+
+    ListNode* tail = nullptr;
+    Record temp;
+
+    while (fread(&temp, sizeof(Record), 1, file) == 1) {
+        ListNode* newNode = new ListNode(temp);
+        if (!db.head) {
+            db.head = tail = newNode;
+        } else {
+            tail->next = newNode;
+            tail = newNode;
+        }
+        db.count++;
+    }
+    fclose(file);
+    count_stat(STAT_BYTES_READ, db.count * sizeof(Record));
+    return true;
+}
+
+// Каталог дат после вставки записей буфера: сдвигаются только границы периодов
+// после каждой добавленной даты. Нестандартная дата — полная перестройка.
+void add_to_date_directory(const std::vector<Record*>& index, const std::vector<Record*>& added, DateDirectory& dir) {
+    std::vector<size_t> shift(period_count + 1, 0);
+    for (const Record* r : added) {
+        int period = date_period(r->settleDate);
+        if (period < 0 || dir.offsets.empty()) {
+            build_date_directory(index, dir);
+            return;
+        }
+        shift[period + 1]++;
+    }
+    for (int p = 0; p < period_count; ++p) {
+        shift[p + 1] += shift[p];
+        dir.offsets[p + 1] += shift[p + 1];
+    }
+}
+
+// Слияние буфера добавлений с базой за O(n + d log d): сортируется только буфер,
+// место каждой записи в индексе ищется двоичным поиском, участки между ними
+// копируются целиком. В списке перешиваются только соседи добавленных узлов.
+// В неотсортированной базе записи просто дописываются в конец.
+void merge_delta(Database& db) {
+    if (db.delta.empty()) return;
+    if (!db.use_mmap && db.index.empty()) db.index = build_index(db.head);
+
+    std::vector<Record*> merged(db.index.size() + db.delta.size());
+    std::vector<size_t> positions;
+    positions.reserve(db.delta.size());
+    if (db.sorted) std::stable_sort(db.delta.begin(), db.delta.end(), recordPtrLess);
+    auto from = db.index.begin();
+    auto out = merged.begin();
+    for (Record* r : db.delta) {
+        auto to = db.sorted ? std::upper_bound(from, db.index.end(), r, recordPtrLess) : db.index.end();
+        out = std::copy(from, to, out);
+        from = to;
+        positions.push_back(out - merged.begin());
+        *out++ = r;
+    }
+    std::copy(from, db.index.end(), out);
+
+    if (!db.use_mmap) {
+        auto node = [](Record* r) { return reinterpret_cast<ListNode*>(r); };
+        for (size_t k : positions) {
+            node(merged[k])->next = k + 1 < merged.size() ? node(merged[k + 1]) : nullptr;
+            if (k == 0) db.head = node(merged[k]);
+            else node(merged[k - 1])->next = node(merged[k]);
+        }
+    }
+    db.index.swap(merged);
+
+    if (!db.sorted) db.dates.offsets.clear();
+    else if (!db.dates.offsets.empty()) add_to_date_directory(db.index, db.delta, db.dates);
+    db.delta.clear();
+}
+
+// Сортирует базу; индекс после сортировки соответствует порядку записей
+void sort_database(Database& db, SortEngine engine, unsigned threads) {
+    ScopedTimer timer(TIMER_SORT);
+    merge_delta(db);
+    db.dates.offsets.clear();
+    db.sorted = true;
+    if (db.use_mmap) {
+        sort_index(db.index, engine == SORT_NATURAL ? SORT_PARALLEL : engine, threads);
+    } else {
+        sort_list(db.head, engine, threads);
+        db.index.clear();
+    }
+}
+
+void free_database(Database& db) {
+    free_list(db.head);
+    NodePool<ListNode>::instance().release();
+    unmap_base(db.base);
+    db.index.clear();
+    db.dates.offsets.clear();
+    db.appended.clear();
+    db.delta.clear();
+    db.count = 0;
+}
+
+// Индекс и каталог дат для отсортированной базы; добавленные записи сливаются
+// здесь, так что любой поиск видит их сразу
+void prepare_search(Database& db) {
+    merge_delta(db);
+    if (db.index.empty()) db.index = build_index(db.head);
+    if (db.dates.offsets.empty()) build_date_directory(db.index, db.dates);
+}
+
+// Размер буфера добавлений, при котором он сливается с базой не дожидаясь поиска
+const size_t delta_merge_threshold = 4096;
+
+// Запись в буфер добавлений: узел списка или элемент deque, адрес не меняется
+Record* add_delta(Database& db, const Record& r) {
+    Record* stored;
+    if (db.use_mmap) {
+        db.appended.push_back(r);
+        stored = &db.appended.back();
+    } else {
+        stored = &(new ListNode(r))->data;
+    }
+    db.delta.push_back(stored);
+    ++db.count;
+    if (db.delta.size() >= delta_merge_threshold) merge_delta(db);
+    return stored;
+}
+
+// Дописывает записи в конец файла базы одним fwrite
+bool append_to_file(const char* filename, const Record* records, size_t count) {
+    FILE* out = fopen(filename, "ab");
+    if (!out) return false;
+    bool ok = fwrite(records, sizeof(Record), count, out) == count;
+    if (fclose(out) != 0) ok = false;
+    if (ok) count_stat(STAT_BYTES_WRITTEN, count * sizeof(Record));
+    return ok;
+}
+
+// Запись в файл и в буфер добавлений: файл остаётся источником, снимок при этом устаревает
+bool append_records(const char* filename, Database& db, const Record* records, size_t count) {
+    if (!append_to_file(filename, records, count)) return false;
+    for (size_t i = 0; i < count; ++i) add_delta(db, records[i]);
+    return true;
+}
+
+// Снимок отсортированной базы рядом с исходным файлом (ФАЙЛ.snap): записи в порядке
+// сортировки, каталог дат и хвост с размером, временем изменения и хешем исходного файла.
+// Записи лежат с начала файла, поэтому снимок отображается в память как обычная база.
+const char snapshot_magic[4] = {'S', 'N', 'A', 'P'};
+const unsigned int snapshot_version = 1;
+
+struct SnapshotTrailer {
+    char magic[4];
+    unsigned int version;
+    unsigned long long record_count;
+    unsigned long long directory_size;  // period_count + 1 или 0, если каталога нет
+    unsigned long long source_size;
+    long long source_mtime_sec;
+    long long source_mtime_nsec;
+    unsigned long long source_hash;
+};
+
+std::string snapshot_name(const char* filename) {
+    return std::string(filename) + ".snap";
+}
+
+// FNV-1a по 8-байтовым словам файла; байты хвоста — по одному
+bool source_hash(const char* filename, unsigned long long& hash) {
+    const unsigned long long prime = 1099511628211ULL;
+    hash = 14695981039346656037ULL;
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    std::vector<unsigned char> block(io_block_size);
+    size_t n;
+    while ((n = fread(block.data(), 1, block.size(), file)) > 0) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            unsigned long long word;
+            memcpy(&word, block.data() + i, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < n; ++i) hash = (hash ^ block[i]) * prime;
+    }
+    fclose(file);
+    return true;
+}
+
+bool save_snapshot(const char* filename, Database& db) {
+    if (!db.sorted) return false;
+    prepare_search(db);
+
+    SnapshotTrailer trailer = {};
+    memcpy(trailer.magic, snapshot_magic, 4);
+    trailer.version = snapshot_version;
+    trailer.record_count = db.index.size();
+    trailer.directory_size = db.dates.offsets.size();
+    struct stat st;
+    if (stat(filename, &st) != 0 || !source_hash(filename, trailer.source_hash)) return false;
+    trailer.source_size = st.st_size;
+    trailer.source_mtime_sec = st.st_mtim.tv_sec;
+    trailer.source_mtime_nsec = st.st_mtim.tv_nsec;
+
+    // пишется во временный файл и переименовывается, чтобы недописанный снимок не подхватился
+    std::string name = snapshot_name(filename);
+    std::string temp = name + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out) return false;
+
+    const size_t chunk = io_block_size / sizeof(Record);
+    std::vector<Record> buffer(chunk);
+    bool ok = true;
+    for (size_t start = 0; start < db.index.size() && ok; start += chunk) {
+        size_t n = std::min(chunk, db.index.size() - start);
+        for (size_t i = 0; i < n; ++i) buffer[i] = *db.index[start + i];
+        ok = fwrite(buffer.data(), sizeof(Record), n, out) == n;
+    }
+    for (size_t offset : db.dates.offsets) {
+        unsigned long long value = offset;
+        if (ok) ok = fwrite(&value, sizeof(value), 1, out) == 1;
+    }
+    ok = ok && fwrite(&trailer, sizeof(trailer), 1, out) == 1;
+    if (fclose(out) != 0) ok = false;
+    if (ok) ok = rename(temp.c_str(), name.c_str()) == 0;
+    if (!ok) remove(temp.c_str());
+    if (ok) count_stat(STAT_BYTES_WRITTEN, trailer.record_count * sizeof(Record) + sizeof(trailer));
+    return ok;
+}
+
+// Загружает снимок, если он соответствует исходному файлу; иначе база не меняется
+bool load_snapshot(const char* filename, Database& db) {
+    ScopedTimer timer(TIMER_LOAD);
+    struct stat source;
+    if (stat(filename, &source) != 0) return false;
+
+    std::string name = snapshot_name(filename);
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    SnapshotTrailer trailer;
+    bool ok = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(trailer) &&
+              pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == (ssize_t)sizeof(trailer);
+    ok = ok && memcmp(trailer.magic, snapshot_magic, 4) == 0 && trailer.version == snapshot_version &&
+         (trailer.directory_size == 0 || trailer.directory_size == period_count + 1) &&
+         trailer.record_count == (unsigned long long)source.st_size / sizeof(Record) &&
+         trailer.record_count * sizeof(Record) + trailer.directory_size * sizeof(unsigned long long) +
+                 sizeof(trailer) == (unsigned long long)st.st_size &&
+         trailer.source_size == (unsigned long long)source.st_size &&
+         trailer.source_mtime_sec == source.st_mtim.tv_sec && trailer.source_mtime_nsec == source.st_mtim.tv_nsec;
+
+    unsigned long long hash = 0;
+    ok = ok && source_hash(filename, hash) && hash == trailer.source_hash;
+
+    void* addr = MAP_FAILED;
+    if (ok) addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+
+    db.use_mmap = true;
+    db.sorted = true;
+    db.head = nullptr;
+    db.appended.clear();
+    db.delta.clear();
+    db.base.records = static_cast<Record*>(addr);
+    db.base.count = trailer.record_count;
+    db.base.size = st.st_size;
+    db.count = trailer.record_count;
+    db.index = build_index(db.base.records, db.base.count);
+
+    const unsigned char* directory = static_cast<const unsigned char*>(addr) + db.count * sizeof(Record);
+    db.dates.offsets.resize(trailer.directory_size);
+    for (size_t p = 0; p < db.dates.offsets.size(); ++p) {
+        unsigned long long value;
+        memcpy(&value, directory + p * sizeof(value), sizeof(value));
+        db.dates.offsets[p] = value;
+    }
+    count_stat(STAT_BYTES_READ, st.st_size);
+    return true;
+}
+
+// Составные запросы: конъюнкция необязательных условий по полям записи.
+// Планировщик оценивает точное число кандидатов для каждого пути доступа
+// (каталог дат, индекс улиц, индекс домов) и выбирает наименьший; остальные
+// условия проверяются курсором на каждой записи-кандидате.
+const int query_date_min = 101;     // 01.01.00
+const int query_date_max = 991231;  // 31.12.99
+
+struct Query {
+    int date_low = query_date_min;      // даты как числа yymmdd, см. date_value
+    int date_high = query_date_max;
+    bool has_dates = false;
+    std::string street;         // в cp866, без пробелов-заполнителей
+    bool has_street = false;
+    int house_low = -32768;
+    int house_high = 32767;
+    bool has_house = false;
+    int flat_low = -32768;
+    int flat_high = 32767;
+    bool has_flat = false;
+};
+
+bool query_matches(const Query& q, const Record* r) {
+    if (q.has_dates) {
+        int d = date_value(r->settleDate);
+        if (d < q.date_low || d > q.date_high) return false;
+    }
+    if (q.has_house && (r->house < q.house_low || r->house > q.house_high)) return false;
+    if (q.has_flat && (r->flat < q.flat_low || r->flat > q.flat_high)) return false;
+    return !q.has_street || street_text(r->street) == q.street;
+}
+
+// Индексы полей над отсортированным индексом базы: для каждой улицы и каждого дома —
+// позиции его записей в db.index по возрастанию, все списки лежат в двух массивах
+struct FieldIndexes {
+    std::map<std::string, unsigned> street_ids;
+    std::vector<size_t> street_offsets;   // записи улицы s — by_street[street_offsets[s]..street_offsets[s+1])
+    std::vector<size_t> by_street;
+    std::vector<short> houses;            // различные номера домов по возрастанию
+    std::vector<size_t> house_offsets;
+    std::vector<size_t> by_house;
+};
+
+void build_field_indexes(const std::vector<Record*>& index, FieldIndexes& fields) {
+    size_t n = index.size();
+    fields.street_ids.clear();
+    std::vector<unsigned> ids(n);
+    for (size_t i = 0; i < n; ++i) {
+        std::string name = street_text(index[i]->street);
+        auto it = fields.street_ids.emplace(name, fields.street_ids.size()).first;
+        ids[i] = it->second;
+    }
+
+    // подсчётом: позиции внутри каждой улицы остаются упорядоченными
+    fields.street_offsets.assign(fields.street_ids.size() + 1, 0);
+    for (unsigned id : ids) fields.street_offsets[id + 1]++;
+    for (size_t s = 0; s + 1 < fields.street_offsets.size(); ++s) {
+        fields.street_offsets[s + 1] += fields.street_offsets[s];
+    }
+    fields.by_street.resize(n);
+    std::vector<size_t> fill(fields.street_offsets.begin(), fields.street_offsets.end() - 1);
+    for (size_t i = 0; i < n; ++i) fields.by_street[fill[ids[i]]++] = i;
+
+    // дома — тем же подсчётом по 65536 возможным значениям short
+    std::vector<size_t> counts(65536 + 1, 0);
+    for (const Record* r : index) counts[(unsigned short)(r->house + 32768) + 1]++;
+    fields.houses.clear();
+    fields.house_offsets.clear();
+    for (int h = 0; h < 65536; ++h) {
+        if (counts[h + 1]) {
+            fields.houses.push_back((short)(h - 32768));
+            fields.house_offsets.push_back(counts[h]);
+        }
+        counts[h + 1] += counts[h];
+    }
+    fields.house_offsets.push_back(n);
+    fields.by_house.resize(n);
+    for (size_t i = 0; i < n; ++i) fields.by_house[counts[(unsigned short)(index[i]->house + 32768)]++] = i;
+}
+
+enum QuerySource {
+    SOURCE_SCAN,
+    SOURCE_DATES,
+    SOURCE_STREET,
+    SOURCE_HOUSE
+};
+
+const char* query_source_name(QuerySource source) {
+    switch (source) {
+        case SOURCE_DATES: return "dates";
+        case SOURCE_STREET: return "street";
+        case SOURCE_HOUSE: return "house";
+        default: return "scan";
+    }
+}
+
+// План: либо срез [begin, end) индекса, либо список отрезков позиций из индекса полей
+struct QueryPlan {
+    QuerySource source;
+    size_t begin;
+    size_t end;
+    std::vector<std::pair<const size_t*, const size_t*>> spans;
+    size_t candidates;
+};
+
+// Отрезки списков позиций, обрезанные до среза [begin, end) индекса
+size_t clip_spans(const size_t* first, const size_t* last, size_t begin, size_t end,
+                  std::vector<std::pair<const size_t*, const size_t*>>& spans) {
+    const size_t* from = std::lower_bound(first, last, begin);
+    const size_t* to = std::lower_bound(from, last, end);
+    if (from != to) spans.emplace_back(from, to);
+    return to - from;
+}
+
+QueryPlan plan_query(const std::vector<Record*>& index, const DateDirectory& dir,
+                     const FieldIndexes& fields, const Query& q) {
+    QueryPlan plan;
+    plan.source = SOURCE_SCAN;
+    plan.begin = 0;
+    plan.end = index.size();
+
+    // диапазон дат сужает все остальные пути, так как индекс отсортирован по дате
+    if (q.has_dates) {
+        QueryDate from = {q.date_low % 100, q.date_low / 100 % 100, q.date_low / 10000};
+        QueryDate to = {q.date_high % 100, q.date_high / 100 % 100, q.date_high / 10000};
+        IndexRange range = date_range(index, dir, from, to);
+        plan.source = SOURCE_DATES;
+        plan.begin = range.begin;
+        plan.end = range.end;
+    }
+    plan.candidates = plan.end - plan.begin;
+
+    if (q.has_street) {
+        std::vector<std::pair<const size_t*, const size_t*>> spans;
+        size_t count = 0;
+        auto it = fields.street_ids.find(q.street);
+        if (it != fields.street_ids.end()) {
+            const size_t* base = fields.by_street.data();
+            count = clip_spans(base + fields.street_offsets[it->second], base + fields.street_offsets[it->second + 1],
+                               plan.begin, plan.end, spans);
+        }
+        if (count < plan.candidates) {
+            plan.source = SOURCE_STREET;
+            plan.spans.swap(spans);
+            plan.candidates = count;
+        }
+    }
+
+    if (q.has_house) {
+        std::vector<std::pair<const size_t*, const size_t*>> spans;
+        size_t count = 0;
+        size_t h = std::lower_bound(fields.houses.begin(), fields.houses.end(), q.house_low) - fields.houses.begin();
+        const size_t* base = fields.by_house.data();
+        for (; h < fields.houses.size() && fields.houses[h] <= q.house_high && count < plan.candidates; ++h) {
+            count += clip_spans(base + fields.house_offsets[h], base + fields.house_offsets[h + 1],
+                                plan.begin, plan.end, spans);
+        }
+        if (count < plan.candidates) {
+            plan.source = SOURCE_HOUSE;
+            plan.spans.swap(spans);
+            plan.candidates = count;
+        }
+    }
+    return plan;
+}
+
+// Ленивый курсор по плану: next() отдаёт очередную подходящую запись или nullptr
+struct QueryCursor {
+    const std::vector<Record*>* index;
+    Query query;
+    QueryPlan plan;
+    size_t pos;
+    size_t span;
+    const size_t* cursor;
+
+    QueryCursor(const std::vector<Record*>& records, const Query& q, QueryPlan p)
+        : index(&records), query(q), plan(std::move(p)), pos(plan.begin), span(0),
+          cursor(plan.spans.empty() ? nullptr : plan.spans[0].first) {}
+
+    Record* next() {
+        if (plan.source == SOURCE_SCAN || plan.source == SOURCE_DATES) {
+            while (pos < plan.end) {
+                Record* r = (*index)[pos++];
+                if (query_matches(query, r)) return r;
+            }
+            return nullptr;
+        }
+        while (span < plan.spans.size()) {
+            if (cursor == plan.spans[span].second) {
+                if (++span < plan.spans.size()) cursor = plan.spans[span].first;
+                continue;
+            }
+            Record* r = (*index)[*cursor++];
+            if (query_matches(query, r)) return r;
+        }
+        return nullptr;
+    }
+};
+
+QueryCursor run_query(const std::vector<Record*>& index, const DateDirectory& dir,
+                      const FieldIndexes& fields, const Query& q) {
+    return QueryCursor(index, q, plan_query(index, dir, fields, q));
+}
+
+// "A" или "A-B"
+bool parse_int_range(const char* text, int& low, int& high) {
+    int consumed = 0;
+    if (sscanf(text, "%d-%d%n", &low, &high, &consumed) == 2 && text[consumed] == '\0') return low <= high;
+    if (sscanf(text, "%d%n", &low, &consumed) == 1 && text[consumed] == '\0') {
+        high = low;
+        return true;
+    }
+    return false;
+}
+
+// Одно условие запроса: year ГГ, from ДАТА, to ДАТА, street УЛИЦА, house A[-B], flat A[-B]
+bool add_query_condition(Query& q, const char* field, const char* value) {
+    if (strcmp(field, "year") == 0) {
+        int year = atoi(value);
+        if (year < 0 || year > 99) return false;
+        q.date_low = std::max(q.date_low, year * 10000 + 101);
+        q.date_high = std::min(q.date_high, year * 10000 + 1231);
+        q.has_dates = true;
+    } else if (strcmp(field, "from") == 0 || strcmp(field, "to") == 0) {
+        QueryDate date;
+        if (!parse_query_date(value, date)) return false;
+        if (field[0] == 'f') q.date_low = std::max(q.date_low, date_value(date));
+        else q.date_high = std::min(q.date_high, date_value(date));
+        q.has_dates = true;
+    } else if (strcmp(field, "street") == 0) {
+        std::string name = utf8_to_cp866(value);
+        q.street = name.substr(0, last_non_space(name.c_str(), (int)name.size()) + 1);
+        q.has_street = true;
+    } else if (strcmp(field, "house") == 0) {
+        if (!parse_int_range(value, q.house_low, q.house_high)) return false;
+        q.has_house = true;
+    } else if (strcmp(field, "flat") == 0) {
+        if (!parse_int_range(value, q.flat_low, q.flat_high)) return false;
+        q.has_flat = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Приведение cp866 к нижнему регистру: А-П (0x80-0x8F) -> а-п (0xA0-0xAF),
+// Р-Я (0x90-0x9F) -> р-я (0xE0-0xEF), пары Ё/ё, Є/є, Ї/ї, Ў/ў (0xF0-0xF7), латиница
+struct Cp866Fold {
+    unsigned char map[256];
+
+    Cp866Fold() {
+        for (int c = 0; c < 256; ++c) map[c] = (unsigned char)c;
+        for (int c = 'A'; c <= 'Z'; ++c) map[c] = (unsigned char)(c + 32);
+        for (int c = 0x80; c <= 0x8F; ++c) map[c] = (unsigned char)(c + 0x20);
+        for (int c = 0x90; c <= 0x9F; ++c) map[c] = (unsigned char)(c + 0x50);
+        for (int c = 0xF0; c <= 0xF7; c += 2) map[c] = (unsigned char)(c + 1);
+    }
+};
+
+const Cp866Fold cp866_fold;
+
+// Строка запроса из UTF-8 в cp866 нижнего регистра
+std::string fold_query(const char* utf8) {
+    std::string s = utf8_to_cp866(utf8);
+    for (char& c : s) c = (char)cp866_fold.map[(unsigned char)c];
+    return s;
+}
+
+// Индекс по ФИО. Одинаковые ФИО (после приведения регистра и обрезки заполнителей)
+// хранятся один раз, отсортированными: поиск по началу фамилии — двоичный поиск
+// по этому массиву, он заменяет префиксное дерево без узлов в куче. Для поиска
+// подстроки — списки триграмм в сжатом построчном виде: для каждой триграммы
+// номера содержащих её имён по возрастанию.
+struct FioIndex {
+    std::vector<char> text;                 // различные ФИО подряд
+    std::vector<unsigned> name_start;       // имя i — text[name_start[i]..name_start[i+1])
+    std::vector<unsigned> record_offsets;   // записи имени i — records[record_offsets[i]..record_offsets[i+1])
+    std::vector<unsigned> records;          // позиции в индексе базы
+    std::vector<unsigned> trigrams;         // различные триграммы по возрастанию
+    std::vector<unsigned> trigram_offsets;
+    std::vector<unsigned> postings;         // номера имён
+};
+
+void build_fio_index(const std::vector<Record*>& index, FioIndex& fio) {
+    const size_t width = sizeof(Record::fio);
+    size_t n = index.size();
+    std::vector<unsigned char> folded(n * width, 0);
+    std::vector<unsigned char> lengths(n);
+    for (size_t i = 0; i < n; ++i) {
+        const char* src = index[i]->fio;
+        int len = last_non_space(src, (int)strnlen(src, width)) + 1;
+        unsigned char* dst = folded.data() + i * width;
+        for (int k = 0; k < len; ++k) dst[k] = cp866_fold.map[(unsigned char)src[k]];
+        lengths[i] = (unsigned char)len;
+    }
+
+    // хвосты дополнены нулями, поэтому ключи сравниваются целиком; при равных ФИО — по позиции
+    std::vector<unsigned> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+        int c = memcmp(folded.data() + (size_t)a * width, folded.data() + (size_t)b * width, width);
+        return c != 0 ? c < 0 : a < b;
+    });
+
+    fio.text.clear();
+    fio.name_start.clear();
+    fio.record_offsets.clear();
+    fio.records.resize(n);
+    for (size_t k = 0; k < n; ++k) {
+        unsigned i = order[k];
+        const unsigned char* key = folded.data() + (size_t)i * width;
+        if (k == 0 || memcmp(key, folded.data() + (size_t)order[k - 1] * width, width) != 0) {
+            fio.name_start.push_back(fio.text.size());
+            fio.record_offsets.push_back(k);
+            fio.text.insert(fio.text.end(), key, key + lengths[i]);
+        }
+        fio.records[k] = i;
+    }
+    fio.name_start.push_back(fio.text.size());
+    fio.record_offsets.push_back(n);
+
+    // пары (триграмма, имя); имена перебираются по возрастанию, так что списки выходят упорядоченными
+    std::vector<std::pair<unsigned, unsigned>> pairs;
+    size_t names = fio.name_start.size() - 1;
+    for (size_t id = 0; id < names; ++id) {
+        const unsigned char* s = (const unsigned char*)fio.text.data() + fio.name_start[id];
+        size_t len = fio.name_start[id + 1] - fio.name_start[id];
+        for (size_t k = 0; k + 3 <= len; ++k) {
+            pairs.emplace_back((unsigned)s[k] << 16 | (unsigned)s[k + 1] << 8 | s[k + 2], (unsigned)id);
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    fio.trigrams.clear();
+    fio.trigram_offsets.clear();
+    fio.postings.resize(pairs.size());
+    for (size_t k = 0; k < pairs.size(); ++k) {
+        if (k == 0 || pairs[k].first != pairs[k - 1].first) {
+            fio.trigrams.push_back(pairs[k].first);
+            fio.trigram_offsets.push_back(k);
+        }
+        fio.postings[k] = pairs[k].second;
+    }
+    fio.trigram_offsets.push_back(pairs.size());
+}
+
+// Позиции записей всех имён из names, по возрастанию (то есть в порядке индекса)
+void collect_fio_records(const FioIndex& fio, const std::vector<unsigned>& names, std::vector<size_t>& positions) {
+    positions.clear();
+    for (unsigned id : names) {
+        positions.insert(positions.end(), fio.records.begin() + fio.record_offsets[id],
+                         fio.records.begin() + fio.record_offsets[id + 1]);
+    }
+    std::sort(positions.begin(), positions.end());
+}
+
+// ФИО, начинающиеся с query (cp866, нижний регистр)
+void find_fio_prefix(const FioIndex& fio, const std::string& query, std::vector<size_t>& positions) {
+    size_t names = fio.name_start.size() - 1;
+    auto name_less = [&](unsigned id, const std::string& q) {
+        size_t len = fio.name_start[id + 1] - fio.name_start[id];
+        int c = memcmp(fio.text.data() + fio.name_start[id], q.data(), std::min(len, q.size()));
+        return c != 0 ? c < 0 : len < q.size();
+    };
+    // имена с общим префиксом идут подряд: от первого не меньшего query до первого без префикса
+    unsigned lo = 0, hi = names;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (name_less(mid, query)) lo = mid + 1;
+        else hi = mid;
+    }
+    std::vector<unsigned> found;
+    for (unsigned id = lo; id < names; ++id) {
+        size_t len = fio.name_start[id + 1] - fio.name_start[id];
+        if (len < query.size() || memcmp(fio.text.data() + fio.name_start[id], query.data(), query.size()) != 0) break;
+        found.push_back(id);
+    }
+    collect_fio_records(fio, found, positions);
+}
+
+// ФИО, содержащие query (cp866, нижний регистр). Кандидаты — пересечение списков
+// всех триграмм запроса, начиная с самого короткого; затем проверка подстроки.
+// Запросы короче трёх символов проверяются по всем различным ФИО.
+void find_fio_substring(const FioIndex& fio, const std::string& query, std::vector<size_t>& positions) {
+    size_t names = fio.name_start.size() - 1;
+    std::vector<unsigned> candidates;
+
+    if (query.size() < 3) {
+        candidates.resize(names);
+        for (size_t id = 0; id < names; ++id) candidates[id] = id;
+    } else {
+        std::vector<std::pair<const unsigned*, const unsigned*>> lists;
+        const unsigned char* q = (const unsigned char*)query.data();
+        for (size_t k = 0; k + 3 <= query.size(); ++k) {
+            unsigned key = (unsigned)q[k] << 16 | (unsigned)q[k + 1] << 8 | q[k + 2];
+            auto it = std::lower_bound(fio.trigrams.begin(), fio.trigrams.end(), key);
+            if (it == fio.trigrams.end() || *it != key) {
+                positions.clear();
+                return;
+            }
+            size_t t = it - fio.trigrams.begin();
+            lists.emplace_back(fio.postings.data() + fio.trigram_offsets[t],
+                               fio.postings.data() + fio.trigram_offsets[t + 1]);
+        }
+        std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) {
+            return a.second - a.first < b.second - b.first;
+        });
+        candidates.assign(lists[0].first, lists[0].second);
+        std::vector<unsigned> next;
+        for (size_t l = 1; l < lists.size() && !candidates.empty(); ++l) {
+            next.clear();
+            std::set_intersection(candidates.begin(), candidates.end(), lists[l].first, lists[l].second,
+                                  std::back_inserter(next));
+            candidates.swap(next);
+        }
+    }
+
+    std::vector<unsigned> found;
+    for (unsigned id : candidates) {
+        const char* s = fio.text.data() + fio.name_start[id];
+        size_t len = fio.name_start[id + 1] - fio.name_start[id];
+        if (memmem(s, len, query.data(), query.size())) found.push_back(id);
+    }
+    collect_fio_records(fio, found, positions);
+}
+
+struct Options {
+    bool use_mmap;
+    bool use_snapshot;
+    unsigned threads;
+    SortEngine engine;
+    CoderEngine coder;
+    const char* filename;
+    std::vector<const char*> args;
+};
+
+// Строка замера фазы в stderr, по одному JSON-объекту на строку
+void report_phase(const char* phase, double ms, size_t records, size_t bytes) {
+    double seconds = ms / 1000.0;
+    double records_per_s = seconds > 0 ? records / seconds : 0;
+    double mb_per_s = seconds > 0 ? bytes / 1048576.0 / seconds : 0;
+    fprintf(stderr, "{\"phase\":\"%s\",\"ms\":%.3f,\"records\":%zu,\"bytes\":%zu,"
+                    "\"records_per_s\":%.0f,\"mb_per_s\":%.2f}\n",
+            phase, ms, records, bytes, records_per_s, mb_per_s);
+}
+
+std::string trimmed_utf8(const char* field, int n) {
+    std::string s = cp866_to_utf8(field, n);
+    int last = last_non_space(s.c_str(), (int)s.size());
+    s.resize(last + 1);
+    return s;
+}
+
+// Длина строки записи в UTF-8 с запасом: до трёх байт на символ, числа, разделители
+const size_t record_line_max = (sizeof(Record::fio) + sizeof(Record::street) + sizeof(Record::settleDate)) * 3 + 32;
+
+// Поле cp866 до NUL без пробелов-заполнителей, в dst; возвращает число байт
+size_t put_trimmed_utf8(const char* field, size_t n, char* dst) {
+    n = strnlen(field, n);
+    return cp866_to_utf8(field, last_non_space(field, (int)n) + 1, dst);
+}
+
+size_t put_int(int value, char* dst) {
+    char digits[12];
+    unsigned v = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    size_t len = 0;
+    if (value < 0) dst[len++] = '-';
+    while (n > 0) dst[len++] = digits[--n];
+    return len;
+}
+
+// Запись одной строкой с табуляциями, пробелы-заполнители обрезаются.
+// В dst нужно record_line_max байт; возвращает длину строки вместе с '\n'
+size_t format_record_line(const Record* r, char* dst) {
+    char* out = dst;
+    out += put_trimmed_utf8(r->fio, sizeof(r->fio), out);
+    *out++ = '\t';
+    out += put_trimmed_utf8(r->street, sizeof(r->street), out);
+    *out++ = '\t';
+    out += put_int(r->house, out);
+    *out++ = '\t';
+    out += put_int(r->flat, out);
+    *out++ = '\t';
+    out += put_trimmed_utf8(r->settleDate, sizeof(r->settleDate), out);
+    *out++ = '\n';
+    return out - dst;
+}
+
+// Пакетное преобразование: строки записей подряд в dst (count * record_line_max байт)
+size_t format_record_lines(Record* const* records, size_t count, char* dst) {
+    char* out = dst;
+    for (size_t i = 0; i < count; ++i) out += format_record_line(records[i], out);
+    return out - dst;
+}
+
+void print_record_line(const Record* r) {
+    char line[record_line_max];
+    fwrite(line, 1, format_record_line(r, line), stdout);
+}
+
+// Массив записей в stdout пачками по 4096 строк через один буфер
+void print_record_lines(Record* const* records, size_t count) {
+    const size_t batch = 4096;
+    std::vector<char> buffer(batch * record_line_max);
+    for (size_t i = 0; i < count; i += batch) {
+        size_t n = std::min(batch, count - i);
+        fwrite(buffer.data(), 1, format_record_lines(records + i, n, buffer.data()), stdout);
+    }
+}
+
+enum ExportFormat { EXPORT_CSV, EXPORT_JSONL };
+
+bool parse_export_format(const char* name, ExportFormat& format) {
+    if (strcmp(name, "csv") == 0) format = EXPORT_CSV;
+    else if (strcmp(name, "jsonl") == 0) format = EXPORT_JSONL;
+    else return false;
+    return true;
+}
+
+// Самая длинная строка экспорта: каждый байт текстовых полей может стать \u00XX
+const size_t export_record_max = (sizeof(Record::fio) + sizeof(Record::street) + sizeof(Record::settleDate)) * 6 + 128;
+
+// Потоковый экспорт: строки копятся в буфере постоянного размера и уходят
+// в файл крупными write, так что память не зависит от размера выборки
+struct ExportWriter {
+    int fd;
+    ExportFormat format;
+    std::vector<char> buffer;
+    size_t used;
+    size_t records;
+    size_t bytes;
+    bool failed;
+};
+
+const size_t export_buffer_size = 4 << 20;
+
+bool flush_export(ExportWriter& w) {
+    const char* p = w.buffer.data();
+    size_t left = w.used;
+    while (left > 0 && !w.failed) {
+        ssize_t n = write(w.fd, p, left);
+        if (n <= 0) w.failed = true;
+        else {
+            p += n;
+            left -= n;
+        }
+    }
+    // учитывается только то, что действительно записано
+    size_t written = w.used - left;
+    w.bytes += written;
+    count_stat(STAT_BYTES_WRITTEN, written);
+    w.used = 0;
+    return !w.failed;
+}
+
+// путь "-" — stdout
+bool open_export(const char* path, ExportFormat format, ExportWriter& w) {
+    w.fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    w.format = format;
+    w.buffer.resize(export_buffer_size);
+    w.used = 0;
+    w.records = 0;
+    w.bytes = 0;
+    w.failed = w.fd < 0;
+    if (w.failed) return false;
+    if (format == EXPORT_CSV) {
+        const char header[] = "fio,street,house,flat,settle_date\n";
+        memcpy(w.buffer.data(), header, sizeof(header) - 1);
+        w.used = sizeof(header) - 1;
+    }
+    return true;
+}
+
+bool close_export(ExportWriter& w) {
+    if (w.fd >= 0) {
+        flush_export(w);
+        if (w.fd != STDOUT_FILENO && close(w.fd) != 0) w.failed = true;
+        w.fd = -1;
+    }
+    w.buffer = std::vector<char>();
+    return !w.failed;
+}
+
+// Текстовое поле: обрезка заполнителей, перекодировка и экранирование.
+// CSV — в кавычках с удвоением кавычек, JSON — строка с \" \\ и \u00XX
+char* put_export_text(ExportFormat format, const char* field, size_t n, char* out) {
+    char text[sizeof(Record::fio) * 3];
+    size_t len = put_trimmed_utf8(field, n, text);
+    *out++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (format == EXPORT_CSV) {
+            if (c == '"') *out++ = '"';
+            *out++ = (char)c;
+        } else if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)c;
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+void export_record(ExportWriter& w, const Record* r) {
+    if (w.used + export_record_max > w.buffer.size() && !flush_export(w)) return;
+    char* out = w.buffer.data() + w.used;
+    if (w.format == EXPORT_CSV) {
+        out = put_export_text(w.format, r->fio, sizeof(r->fio), out);
+        *out++ = ',';
+        out = put_export_text(w.format, r->street, sizeof(r->street), out);
+        *out++ = ',';
+        out += put_int(r->house, out);
+        *out++ = ',';
+        out += put_int(r->flat, out);
+        *out++ = ',';
+        out = put_export_text(w.format, r->settleDate, sizeof(r->settleDate), out);
+    } else {
+        memcpy(out, "{\"fio\":", 7);
+        out = put_export_text(w.format, r->fio, sizeof(r->fio), out + 7);
+        memcpy(out, ",\"street\":", 10);
+        out = put_export_text(w.format, r->street, sizeof(r->street), out + 10);
+        memcpy(out, ",\"house\":", 9);
+        out += 9;
+        out += put_int(r->house, out);
+        memcpy(out, ",\"flat\":", 8);
+        out += 8;
+        out += put_int(r->flat, out);
+        memcpy(out, ",\"settle_date\":", 15);
+        out = put_export_text(w.format, r->settleDate, sizeof(r->settleDate), out + 15);
+        *out++ = '}';
+    }
+    *out++ = '\n';
+    w.used = out - w.buffer.data();
+    ++w.records;
+}
+
+// Источники: весь список, диапазон индекса (результат поиска), очередь поиска, дома из АВЛ-дерева
+void export_list(ExportWriter& w, ListNode* head) {
+    for (ListNode* node = head; node && !w.failed; node = node->next) export_record(w, &node->data);
+}
+
+void export_records(ExportWriter& w, Record* const* records, size_t count) {
+    for (size_t i = 0; i < count && !w.failed; ++i) export_record(w, records[i]);
+}
+
+void export_queue(ExportWriter& w, const ::queue<Record*>& q) {
+    q.for_each([&](Record* r) {
+        export_record(w, r);
+        return !w.failed;
+    });
+}
+
+void export_houses(ExportWriter& w, AVLNode* root, int low, int high) {
+    for_each_house(root, low, high, [&](AVLNode* node) {
+        for (size_t i = 0; i < node->residents.size() && !w.failed; ++i) export_record(w, node->residents[i]);
+        return !w.failed;
+    });
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+            "Использование: %s [--mmap] [--threads N] [--engine natural|parallel|radix]\n"
+            "       [--coder fano|huffman] [--no-snapshot] [--stats ФАЙЛ] КОМАНДА ...\n"
+            "  load ФАЙЛ                 загрузить базу\n"
+            "  sort ФАЙЛ                 отсортировать и вывести записи\n"
+            "  year ФАЙЛ ГОД             поиск по году (две цифры)\n"
+            "  house ФАЙЛ ГОД ДОМ        поиск дома в АВЛ-дереве выборки за год\n"
+            "  houses ФАЙЛ ГОД A B       жильцы домов с A по B из выборки за год, по возрастанию\n"
+            "  query ФАЙЛ [year ГГ] [from ДАТА] [to ДАТА] [street УЛИЦА] [house A[-B]] [flat A[-B]]\n"
+            "                            составной запрос; план выбирается по наименьшему числу кандидатов\n"
+            "  dates ФАЙЛ С ПО           записи с датами заселения от С до ПО (дд.мм.гг)\n"
+            "  append ФАЙЛ ИСТОЧНИК      дописать записи ИСТОЧНИКА в базу без полной пересортировки\n"
+            "  append ФАЙЛ ФИО УЛИЦА ДОМ КВ ДАТА  дописать одну запись\n"
+            "  serve ФАЙЛ СОКЕТ          сервер запросов на UNIX-сокете, --threads потоков обслуживания\n"
+            "  client СОКЕТ year ГГ | house ГГ A[-B] | dates С ПО | reload | stop  запрос к серверу\n"
+            "  export ФАЙЛ csv|jsonl ВЫХОД [year ГГ [house A[-B]]]  выгрузить в UTF-8 (ВЫХОД \"-\" — stdout)\n"
+            "                            весь отсортированный список, выборку за год или дома из её АВЛ-дерева\n"
+            "  fio ФАЙЛ prefix|contains ТЕКСТ  записи, ФИО которых начинается с ТЕКСТА или содержит его\n"
+            "  fano ФАЙЛ                 таблица кодов Фано\n"
+            "  coders ФАЙЛ               сравнить кодеры: энтропия, длина кода, скорость\n"
+            "  pack ФАЙЛ ВЫХОД           упаковать файл кодом --coder (по умолчанию Фано)\n"
+            "  packb ФАЙЛ ВЫХОД [ЗАПИСЕЙ] упаковать блоками (по умолчанию 4096 записей) в --threads потоков\n"
+            "  packc ФАЙЛ ВЫХОД          упаковать записи по колонкам со словарём улиц\n"
+            "  unpack АРХИВ ВЫХОД        распаковать файл, созданный pack, packb или packc\n"
+            "  unpackr АРХИВ ВЫХОД ПЕРВАЯ N  распаковать N записей блочного архива начиная с ПЕРВОЙ\n"
+            "  cfind АРХИВ [year ГОД] [street УЛИЦА]  номера записей колоночного архива\n"
+            "  snapshot ФАЙЛ             отсортировать и сохранить снимок ФАЙЛ.snap для быстрого запуска\n"
+            "  extsort ФАЙЛ ВЫХОД [МБ]   внешняя сортировка\n"
+            "  gen ФАЙЛ N [SEED]         сгенерировать синтетическую базу из N записей\n"
+            "  bench [N ...]             замеры всех подсистем на синтетических базах\n"
+            "Без команды запускается интерактивное меню (--file ФАЙЛ задаёт базу).\n"
+            "Если рядом с базой есть актуальный снимок ФАЙЛ.snap, он загружается вместо сортировки.\n"
+            "Результаты выводятся в stdout, замеры фаз — в stderr.\n"
+            "--stats ФАЙЛ включает счётчики и таймеры и пишет их в ФАЙЛ (\"-\" — stderr) в JSON при выходе.\n",
+            program);
+}
+
+bool batch_load(const Options& opt, const char* filename, Database& db) {
+    auto start = std::chrono::steady_clock::now();
+    if (opt.use_snapshot && load_snapshot(filename, db)) {
+        report_phase("load_snapshot", elapsed_ms(start), db.count, db.count * sizeof(Record));
+        return true;
+    }
+    if (!load_database(filename, opt.use_mmap, db)) {
+        fprintf(stderr, "Ошибка открытия файла %s\n", filename);
+        return false;
+    }
+    report_phase("load", elapsed_ms(start), db.count, db.count * sizeof(Record));
+    return true;
+}
+
+void batch_sort(const Options& opt, Database& db) {
+    if (db.sorted && !db.dates.offsets.empty()) return;  // загружен снимок
+
+    auto start = std::chrono::steady_clock::now();
+    sort_database(db, opt.engine, opt.threads);
+    report_phase("sort", elapsed_ms(start), db.count, db.count * sizeof(Record));
+
+    if (db.index.empty()) {
+        start = std::chrono::steady_clock::now();
+        db.index = build_index(db.head);
+        report_phase("index", elapsed_ms(start), db.count, db.count * sizeof(Record*));
+    }
+
+    start = std::chrono::steady_clock::now();
+    build_date_directory(db.index, db.dates);
+    report_phase("date_directory", elapsed_ms(start), db.count, (period_count + 1) * sizeof(size_t));
+}
+
+IndexRange batch_year(Database& db, int year) {
+    auto start = std::chrono::steady_clock::now();
+    IndexRange result;
+    {
+        ScopedTimer timer(TIMER_QUERY);
+        result = year_range(db.index, db.dates, year);
+    }
+    report_phase("year_search", elapsed_ms(start), result.size(), result.size() * sizeof(Record));
+    return result;
+}
+
+IndexRange batch_dates(Database& db, const QueryDate& from, const QueryDate& to) {
+    auto start = std::chrono::steady_clock::now();
+    IndexRange result;
+    {
+        ScopedTimer timer(TIMER_QUERY);
+        result = date_range(db.index, db.dates, from, to);
+    }
+    report_phase("date_search", elapsed_ms(start), result.size(), result.size() * sizeof(Record));
+    return result;
+}
+
+// Сервис запросов по UNIX-сокету. База загружается и индексируется один раз,
+// запросы обслуживает пул потоков по неизменяемому снимку. Перезагрузка строит
+// новый снимок рядом и подменяет указатель атомарно (как RCU): читатели берут
+// текущий снимок через atomic_load и никогда не ждут перезагрузку, старый снимок
+// освобождается вместе с последним ссылающимся на него запросом.
+//
+// Протокол: запрос — ServiceRequest (16 байт), ответ — ServiceResponse и за ним
+// count записей по 64 байта в формате .dat. Соединение обслуживает запросы
+// по очереди, пока клиент его не закроет.
+//
+// Простаивающие соединения ждут в poll принимающего потока; пулу отдаётся только
+// соединение с пришедшим запросом, и после ответа оно возвращается в poll.
+// Поэтому открытые, но молчащие клиенты не занимают потоки пула.
+enum ServiceOp { SERVICE_YEAR = 1, SERVICE_HOUSE, SERVICE_DATES, SERVICE_RELOAD, SERVICE_STOP };
+enum ServiceStatus { SERVICE_OK = 0, SERVICE_BAD_REQUEST, SERVICE_BUSY, SERVICE_FAILED };
+
+struct ServiceRequest {
+    unsigned int op;
+    int year;  // SERVICE_YEAR, SERVICE_HOUSE
+    int low;   // дома (SERVICE_HOUSE) или даты yymmdd (SERVICE_DATES)
+    int high;
+};
+
+struct ServiceResponse {
+    unsigned int status;
+    unsigned int generation;  // номер снимка, по которому получен ответ
+    unsigned long long count;
+};
+
+struct ServiceSnapshot {
+    Database db;
+    FieldIndexes fields;
+    unsigned generation;
+
+    // база сервиса всегда отображена в память: общий пул узлов списка не трогается,
+    // поэтому снимки можно освобождать из любого потока
+    ~ServiceSnapshot() { unmap_base(db.base); }
+};
+
+struct QueryService {
+    std::shared_ptr<const ServiceSnapshot> current;  // только через atomic_load/atomic_store
+    std::mutex reload_lock;                           // одна перезагрузка за раз
+    std::atomic<bool> stopping{false};
+    const Options* opt;
+    const char* filename;
+    int listen_fd;
+    int wake_fd[2];                                   // будит poll принимающего потока
+
+    // соединения, обслуженные пулом: fd и признак, оставлять ли его открытым.
+    // Закрывает соединения только принимающий поток.
+    std::mutex returned_lock;
+    std::vector<std::pair<int, bool>> returned;
+};
+
+// Запрос, начавший приходить, должен дойти целиком за это время, ответ — уйти
+const int service_io_timeout_sec = 5;
+
+void wake_service(QueryService& service) {
+    char byte = 0;
+    ssize_t n = write(service.wake_fd[1], &byte, 1);
+    (void)n;  // канал полон — принимающий поток и так проснётся
+}
+
+void return_connection(QueryService& service, int fd, bool keep) {
+    {
+        std::lock_guard<std::mutex> guard(service.returned_lock);
+        service.returned.emplace_back(fd, keep);
+    }
+    wake_service(service);
+}
+
+std::shared_ptr<const ServiceSnapshot> load_service_snapshot(const Options& opt, const char* filename, unsigned generation) {
+    Options mapped = opt;
+    mapped.use_mmap = true;
+    auto snapshot = std::make_shared<ServiceSnapshot>();
+    if (!batch_load(mapped, filename, snapshot->db)) return nullptr;
+    batch_sort(mapped, snapshot->db);
+    prepare_search(snapshot->db);
+    auto start = std::chrono::steady_clock::now();
+    build_field_indexes(snapshot->db.index, snapshot->fields);
+    report_phase("field_indexes", elapsed_ms(start), snapshot->db.count, snapshot->db.count * 2 * sizeof(size_t));
+    snapshot->generation = generation;
+    return snapshot;
+}
+
+bool read_full(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// MSG_NOSIGNAL: отключившийся клиент не должен завершать сервер сигналом SIGPIPE
+bool send_full(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Запрос сервиса как составной запрос движка; false — неверные параметры
+bool service_query(const ServiceRequest& request, Query& q) {
+    if (request.op == SERVICE_YEAR || request.op == SERVICE_HOUSE) {
+        if (request.year < 0 || request.year > 99) return false;
+        q.date_low = date_value(QueryDate{ 1, 1, request.year });
+        q.date_high = date_value(QueryDate{ 31, 12, request.year });
+        q.has_dates = true;
+    }
+    if (request.op == SERVICE_HOUSE) {
+        if (request.low > request.high) return false;
+        q.house_low = request.low;
+        q.house_high = request.high;
+        q.has_house = true;
+    }
+    if (request.op == SERVICE_DATES) {
+        if (!valid_date_value(request.low) || !valid_date_value(request.high) || request.low > request.high) {
+            return false;
+        }
+        q.date_low = request.low;
+        q.date_high = request.high;
+        q.has_dates = true;
+    }
+    return true;
+}
+
+// Один запрос соединения; false — соединение закрывается
+bool serve_service_request(QueryService& service, int fd) {
+    thread_local std::vector<Record*> found;
+    thread_local std::vector<Record> batch(default_block_records);
+    ServiceRequest request;
+    if (!read_full(fd, &request, sizeof(request))) return false;
+    ServiceResponse response = {};
+    Query q;
+
+    if (request.op == SERVICE_RELOAD) {
+        std::unique_lock<std::mutex> guard(service.reload_lock, std::try_to_lock);
+        if (!guard.owns_lock()) {
+            response.status = SERVICE_BUSY;
+        } else {
+            unsigned generation = std::atomic_load(&service.current)->generation + 1;
+            std::shared_ptr<const ServiceSnapshot> fresh = load_service_snapshot(*service.opt, service.filename, generation);
+            if (fresh) {
+                std::atomic_store(&service.current, fresh);
+                response.generation = generation;
+                response.count = fresh->db.count;
+            } else {
+                response.status = SERVICE_FAILED;
+            }
+        }
+        return send_full(fd, &response, sizeof(response));
+    }
+    if (request.op == SERVICE_STOP) {
+        service.stopping = true;
+        send_full(fd, &response, sizeof(response));
+        wake_service(service);
+        return false;
+    }
+    if ((request.op != SERVICE_YEAR && request.op != SERVICE_HOUSE && request.op != SERVICE_DATES) ||
+        !service_query(request, q)) {
+        response.status = SERVICE_BAD_REQUEST;
+        return send_full(fd, &response, sizeof(response));
+    }
+
+    // снимок удерживается до конца ответа, даже если его уже подменила перезагрузка
+    std::shared_ptr<const ServiceSnapshot> snapshot = std::atomic_load(&service.current);
+    {
+        ScopedTimer timer(TIMER_QUERY);
+        QueryCursor cursor = run_query(snapshot->db.index, snapshot->db.dates, snapshot->fields, q);
+        found.clear();
+        for (Record* r = cursor.next(); r; r = cursor.next()) found.push_back(r);
+    }
+
+    response.generation = snapshot->generation;
+    response.count = found.size();
+    bool sent = send_full(fd, &response, sizeof(response));
+    for (size_t i = 0; sent && i < found.size(); i += batch.size()) {
+        size_t n = std::min(batch.size(), found.size() - i);
+        for (size_t k = 0; k < n; ++k) batch[k] = *found[i + k];
+        sent = send_full(fd, batch.data(), n * sizeof(Record));
+    }
+    return sent;
+}
+
+bool service_address(const char* path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) return false;
+    strcpy(address.sun_path, path);
+    return true;
+}
+
+// Принимающий поток держит в poll сокет, канал пробуждения и простаивающие соединения;
+// запросы выполняют --threads потоков пула (не меньше одного)
+int run_service(const Options& opt, const char* filename, const char* socket_path) {
+    QueryService service;
+    service.opt = &opt;
+    service.filename = filename;
+    std::shared_ptr<const ServiceSnapshot> first = load_service_snapshot(opt, filename, 1);
+    if (!first) {
+        fprintf(stderr, "Ошибка открытия файла %s\n", filename);
+        return 1;
+    }
+    std::atomic_store(&service.current, first);
+    first.reset();
+
+    sockaddr_un address;
+    if (!service_address(socket_path, address)) {
+        fprintf(stderr, "Слишком длинный путь сокета %s\n", socket_path);
+        return 2;
+    }
+    service.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (service.listen_fd < 0 || bind(service.listen_fd, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(service.listen_fd, 64) != 0 || pipe(service.wake_fd) != 0) {
+        fprintf(stderr, "Ошибка создания сокета %s\n", socket_path);
+        if (service.listen_fd >= 0) close(service.listen_fd);
+        return 1;
+    }
+    fcntl(service.listen_fd, F_SETFL, O_NONBLOCK);
+    fcntl(service.wake_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(service.wake_fd[1], F_SETFL, O_NONBLOCK);
+    unsigned workers = std::max(opt.threads, 1u);
+    fprintf(stderr, "{\"phase\":\"serve\",\"socket\":\"%s\",\"workers\":%u}\n", socket_path, workers);
+
+    TaskPool pool(workers + 1);
+    TaskGroup requests;
+    std::vector<int> idle;   // ждут запроса в poll
+    std::vector<int> busy;   // обслуживаются пулом
+    std::vector<pollfd> fds;
+    std::vector<std::pair<int, bool>> returned;
+
+    auto take_returned = [&] {
+        {
+            std::lock_guard<std::mutex> guard(service.returned_lock);
+            returned.swap(service.returned);
+        }
+        for (const std::pair<int, bool>& r : returned) {
+            busy.erase(std::find(busy.begin(), busy.end(), r.first));
+            if (r.second && !service.stopping) idle.push_back(r.first);
+            else close(r.first);
+        }
+        returned.clear();
+    };
+
+    while (!service.stopping) {
+        fds.clear();
+        fds.push_back(pollfd{ service.wake_fd[0], POLLIN, 0 });
+        fds.push_back(pollfd{ service.listen_fd, POLLIN, 0 });
+        for (int fd : idle) fds.push_back(pollfd{ fd, POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[0].revents) {
+            char drain[64];
+            while (read(service.wake_fd[0], drain, sizeof(drain)) > 0) {}
+            take_returned();
+        }
+        // соединение с запросом (или закрытое клиентом) уходит в пул до конца ответа
+        size_t kept = 0;
+        for (size_t i = 2; i < fds.size(); ++i) {
+            int fd = fds[i].fd;
+            if (!fds[i].revents) {
+                idle[kept++] = fd;
+                continue;
+            }
+            busy.push_back(fd);
+            pool.spawn(requests, [&service, fd] {
+                return_connection(service, fd, serve_service_request(service, fd));
+            });
+        }
+        idle.resize(kept);
+
+        if (fds[1].revents) {
+            int fd;
+            while ((fd = accept(service.listen_fd, nullptr, nullptr)) >= 0) {
+                timeval timeout = { service_io_timeout_sec, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                idle.push_back(fd);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) break;
+        }
+    }
+
+    // остановка: новые соединения не принимаются, простаивающие закрываются,
+    // обслуживаемые обрываются shutdown, чтобы их ответы не ждали клиентов
+    service.stopping = true;
+    close(service.listen_fd);
+    unlink(socket_path);
+    for (int fd : idle) close(fd);
+    for (int fd : busy) shutdown(fd, SHUT_RDWR);
+    pool.wait(requests);
+    take_returned();
+    close(service.wake_fd[0]);
+    close(service.wake_fd[1]);
+    return 0;
+}
+
+// Клиент: один запрос, записи ответа в stdout строками с табуляциями
+int run_service_client(const char* socket_path, const ServiceRequest& request) {
+    sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !service_address(socket_path, address) || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Ошибка подключения к %s\n", socket_path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ServiceResponse response;
+    bool ok = send_full(fd, &request, sizeof(request)) && read_full(fd, &response, sizeof(response));
+    std::vector<Record> records;
+    if (ok && request.op != SERVICE_RELOAD && request.op != SERVICE_STOP) {
+        records.resize(response.count);
+        ok = read_full(fd, records.data(), records.size() * sizeof(Record));
+    }
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Ошибка обмена с сервером\n");
+        return 1;
+    }
+    if (response.status != SERVICE_OK) {
+        const char* reasons[] = { "", "неверный запрос", "идёт перезагрузка", "ошибка загрузки базы" };
+        fprintf(stderr, "Сервер: %s\n", response.status < 4 ? reasons[response.status] : "ошибка");
+        return 1;
+    }
+    std::vector<Record*> index = build_index(records.data(), records.size());
+    print_record_lines(index.data(), index.size());
+    fprintf(stderr, "{\"phase\":\"client\",\"ms\":%.3f,\"generation\":%u,\"records\":%llu}\n",
+            elapsed_ms(start), response.generation, response.count);
+    return 0;
+}
+
+// Генератор синтетической базы: ФИО, улицы и даты в том же виде и кодировке, что в testBase4.dat
+struct Rng {
+    unsigned long long state;
+
+    unsigned long long next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    int below(int n) { return (int)(next() % (unsigned long long)n); }
+};
+
+const char* const name_roots[] = {
+    "Гедеон", "Хасан", "Клим", "Глеб", "Тихон", "Демьян", "Архип", "Остап",
+    "Сабир", "Ромуальд", "Филимон", "Евграф", "Ахмед", "Батыр", "Зосим", "Феофан",
+    "Поликарп", "Патрик", "Мстислав", "Ян", "Жак", "Влас", "Никодим", "Муамар",
+    "Пантелемон", "Ахиллес", "Герасим", "Александр"
+};
+const char* const female_names[] = {
+    "Алла", "Нинель", "Варвара", "Марфа", "Алсу", "Саломея", "Изольда", "Виолетта",
+    "Матрена", "Ариадна", "Пелагея", "Изабелла", "Арабелла", "Степанида", "Ада"
+};
+const int name_root_count = sizeof(name_roots) / sizeof(name_roots[0]);
+const int female_name_count = sizeof(female_names) / sizeof(female_names[0]);
+
+// Строковое поле записи: текст в cp866, пробелы до конца и завершающий ноль
+void fill_field(char* dst, int size, const std::string& text) {
+    memset(dst, ' ', size - 1);
+    dst[size - 1] = '\0';
+    memcpy(dst, text.data(), std::min((int)text.size(), size - 1));
+}
+
+// Части имён, заранее переведённые в cp866
+struct NameParts {
+    std::vector<std::string> roots;
+    std::vector<std::string> female;
+    std::string ov, ova, ovoy, ovich, ovna;
+
+    NameParts() {
+        for (int i = 0; i < name_root_count; ++i) roots.push_back(utf8_to_cp866(name_roots[i]));
+        for (int i = 0; i < female_name_count; ++i) female.push_back(utf8_to_cp866(female_names[i]));
+        ov = utf8_to_cp866("ов");
+        ova = utf8_to_cp866("ова");
+        ovoy = utf8_to_cp866("овой");
+        ovich = utf8_to_cp866("ович");
+        ovna = utf8_to_cp866("овна");
+    }
+};
+
+void generate_record(Rng& rng, Record& r) {
+    static const int days_in_month[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    static const NameParts parts;
+
+    bool female = rng.below(2) == 0;
+    std::string fio = parts.roots[rng.below(name_root_count)] + (female ? parts.ova : parts.ov);
+    fio += ' ';
+    fio += female ? parts.female[rng.below(female_name_count)] : parts.roots[rng.below(name_root_count)];
+    fio += ' ';
+    fio += parts.roots[rng.below(name_root_count)] + (female ? parts.ovna : parts.ovich);
+    fill_field(r.fio, 32, fio);
+
+    fill_field(r.street, 18, parts.roots[rng.below(name_root_count)] + (rng.below(2) ? parts.ova : parts.ovoy));
+
+    r.house = (short)(1 + rng.below(50));
+    r.flat = (short)(1 + rng.below(120));
+
+    int year = 93 + rng.below(5);
+    int month = 1 + rng.below(12);
+    int day = 1 + rng.below(days_in_month[month - 1]);
+    char* d = r.settleDate;
+    d[0] = '0' + day / 10;   d[1] = '0' + day % 10;   d[2] = '-';
+    d[3] = '0' + month / 10; d[4] = '0' + month % 10; d[5] = '-';
+    d[6] = '0' + year / 10;  d[7] = '0' + year % 10;
+    d[8] = ' ';
+    d[9] = '\0';
+}
+
+// Запись из введённых полей (UTF-8); false при неверных доме, квартире или дате
+bool make_record(const char* fio, const char* street, int house, int flat, const char* date, Record& r) {
+    QueryDate d;
+    if (!parse_query_date(date, d) || house < 0 || house > 32767 || flat < 0 || flat > 32767) return false;
+    fill_field(r.fio, sizeof(r.fio), utf8_to_cp866(fio));
+    fill_field(r.street, sizeof(r.street), utf8_to_cp866(street));
+    r.house = (short)house;
+    r.flat = (short)flat;
+    char* p = r.settleDate;
+    put_date_part(p, d.day);
+    p[2] = '-';
+    put_date_part(p + 3, d.month);
+    p[5] = '-';
+    put_date_part(p + 6, d.year);
+    p[8] = ' ';
+    p[9] = '\0';
+    return true;
+}
+
+bool generate_base(const char* filename, size_t count, unsigned long long seed) {
+    FILE* out = fopen(filename, "wb");
+    if (!out) return false;
+
+    Rng rng = { seed ? seed : 88172645463325252ULL };
+    std::vector<Record> buffer(16384);
+    bool ok = true;
+    for (size_t done = 0; done < count && ok; ) {
+        size_t n = std::min(buffer.size(), count - done);
+        for (size_t i = 0; i < n; ++i) generate_record(rng, buffer[i]);
+        ok = fwrite(buffer.data(), sizeof(Record), n, out) == n;
+        done += n;
+    }
+    if (fclose(out) != 0) ok = false;
+    return ok;
+}
+
+// Текущая и пиковая резидентная память процесса в КБ
+void read_memory_kb(size_t& rss_kb, size_t& peak_kb) {
+    rss_kb = peak_kb = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) rss_kb = strtoull(line + 6, nullptr, 10);
+        else if (strncmp(line, "VmHWM:", 6) == 0) peak_kb = strtoull(line + 6, nullptr, 10);
+    }
+    fclose(f);
+}
+
+// Сброс пика, чтобы VmHWM показывал максимум отдельной фазы
+void reset_peak_memory() {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+void bench_report(size_t size, const char* phase, double ms, size_t records, size_t bytes) {
+    size_t rss_kb, peak_kb;
+    read_memory_kb(rss_kb, peak_kb);
+    // для поисковых фаз records — число запросов, ns_per_record — время одного запроса
+    double ns_per_record = records ? ms * 1e6 / records : 0;
+    double mb_per_s = ms > 0 ? bytes / 1048576.0 / (ms / 1000.0) : 0;
+    printf("{\"size\":%zu,\"phase\":\"%s\",\"ms\":%.3f,\"records\":%zu,\"ns_per_record\":%.1f,"
+           "\"mb_per_s\":%.2f,\"rss_mb\":%.1f,\"peak_mb\":%.1f}\n",
+           size, phase, ms, records, ns_per_record, mb_per_s, rss_kb / 1024.0, peak_kb / 1024.0);
+    fflush(stdout);
+}
+
+// Прогон всех подсистем на синтетической базе из n записей
+bool bench_size(const Options& opt, size_t n) {
+    std::string filename = "bench_" + std::to_string(n) + ".dat";
+    std::string packed = filename + ".bin";
+    size_t bytes = n * sizeof(Record);
+
+    reset_peak_memory();
+    auto start = std::chrono::steady_clock::now();
+    if (!generate_base(filename.c_str(), n, 12345)) {
+        fprintf(stderr, "Ошибка записи файла %s\n", filename.c_str());
+        return false;
+    }
+    bench_report(n, "generate", elapsed_ms(start), n, bytes);
+
+    std::string unpacked = filename + ".out";
+    // фаза, которая не отработала, не даёт замера: файлы убираются, прогон прерывается
+    auto failed = [&](const char* phase) {
+        fprintf(stderr, "%s: ошибка на %zu записях\n", phase, n);
+        remove(unpacked.c_str());
+        remove(packed.c_str());
+        remove(filename.c_str());
+        return false;
+    };
+
+    Database list;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!load_database(filename.c_str(), false, list)) return failed("load_list");
+    bench_report(n, "load_list", elapsed_ms(start), n, bytes);
+
+    Database mapped;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!load_database(filename.c_str(), true, mapped)) return failed("load_mmap");
+    bench_report(n, "load_mmap", elapsed_ms(start), n, bytes);
+
+    std::vector<Record*> index = mapped.index;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    radix_sort_index(index);
+    bench_report(n, "sort_radix", elapsed_ms(start), n, bytes);
+
+    index = mapped.index;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    parallel_sort(index, opt.threads);
+    bench_report(n, "sort_parallel", elapsed_ms(start), n, bytes);
+    unmap_base(mapped.base);
+    std::vector<Record*>().swap(index);
+    std::vector<Record*>().swap(mapped.index);
+
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    naturalMergeSort(list.head);
+    bench_report(n, "sort_natural", elapsed_ms(start), n, bytes);
+
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    list.index = build_index(list.head);
+    bench_report(n, "index_build", elapsed_ms(start), n, n * sizeof(Record*));
+
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    build_date_directory(list.index, list.dates);
+    bench_report(n, "date_directory", elapsed_ms(start), n, (period_count + 1) * sizeof(size_t));
+
+    size_t found = 0;
+    const int year_queries = 1000;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < year_queries; ++q) {
+        found += year_range(list.index, list.dates, 93 + q % 5).size();
+    }
+    bench_report(n, "year_search", elapsed_ms(start), year_queries, found * sizeof(Record));
+
+    // диапазоны от нескольких дней до нескольких лет
+    const int date_queries = 100000;
+    Rng date_rng = { 0x9E3779B97F4A7C15ULL };
+    found = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < date_queries; ++q) {
+        QueryDate from = { 1 + date_rng.below(28), 1 + date_rng.below(12), 93 + date_rng.below(5) };
+        QueryDate to = { 1 + date_rng.below(28), 1 + date_rng.below(12), from.year + date_rng.below(98 - from.year) };
+        found += date_range(list.index, list.dates, from, to).size();
+    }
+    bench_report(n, "date_range", elapsed_ms(start), date_queries, 0);
+    if (found == 0) fprintf(stderr, "date_range: пустые выборки\n");
+
+    IndexRange selection = year_range(list.index, list.dates, 96);
+    size_t selected = selection.size();
+    AVLNode* root = nullptr;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = selection.begin; i < selection.end; ++i) root = insert(root, list.index[i]);
+    bench_report(n, "avl_build", elapsed_ms(start), selected, selected * sizeof(Record));
+
+    // случайные номера домов, чтобы предсказатель переходов не выучил порядок запросов
+    const int house_queries = 100000;
+    std::vector<int> house_keys(house_queries);
+    Rng house_rng = { 0xD1B54A32D192ED03ULL };
+    for (int& h : house_keys) h = 1 + house_rng.below(60);
+    size_t residents = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < house_queries; ++q) {
+        AVLNode* node = search(root, house_keys[q]);
+        if (node) residents += node->residents.size();
+    }
+    bench_report(n, "avl_search", elapsed_ms(start), house_queries, 0);
+    if (residents == 0) fprintf(stderr, "avl_search: пустая выборка\n");
+
+    HouseIndex houses;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    build_house_index(list.index.data() + selection.begin, selected, houses);
+    bench_report(n, "flat_build", elapsed_ms(start), selected, selected * sizeof(Record));
+
+    size_t flat_residents = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < house_queries; ++q) {
+        flat_residents += search(houses, house_keys[q]).count;
+    }
+    bench_report(n, "flat_search", elapsed_ms(start), house_queries, 0);
+
+    // оба индекса должны отдавать одних и тех же жильцов в одном порядке
+    for (int house = 0; house <= 61; ++house) {
+        AVLNode* node = search(root, house);
+        HouseSlice slice = search(houses, house);
+        if ((node ? node->residents.size() : 0) != slice.count ||
+            (node && !std::equal(node->residents.begin(), node->residents.end(), slice.residents))) {
+            fprintf(stderr, "flat_search: дом %d отличается от АВЛ-дерева\n", house);
+        }
+    }
+    if (flat_residents != residents) fprintf(stderr, "flat_search: число жильцов отличается\n");
+
+    // диапазоны из пяти домов подряд
+    const int house_range_queries = 10000;
+    size_t in_range = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < house_range_queries; ++q) {
+        int low = house_keys[q];
+        for_each_house(root, low, low + 4, [&](AVLNode* node) {
+            in_range += node->residents.size();
+            return true;
+        });
+    }
+    bench_report(n, "avl_range", elapsed_ms(start), house_range_queries, in_range * sizeof(Record));
+
+    // каждый десятый жилец выселяется и заселяется обратно
+    size_t updates = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (size_t i = selection.begin; i < selection.end; i += 10) {
+        root = remove_resident(root, list.index[i]);
+        root = insert(root, list.index[i]);
+        updates += 2;
+    }
+    bench_report(n, "avl_update", elapsed_ms(start), updates, 0);
+    free_tree(root);
+
+    FioIndex fio;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    build_fio_index(list.index, fio);
+    bench_report(n, "fio_index", elapsed_ms(start), n, fio.text.size() + fio.postings.size() * sizeof(unsigned));
+
+    // запросы — начало ФИО (фамилия и часть имени) и кусок из середины случайных записей
+    const int fio_queries = 10000;
+    Rng fio_rng = { 0xC2B2AE3D27D4EB4FULL };
+    std::vector<std::string> fio_prefixes(fio_queries), fio_parts(fio_queries);
+    for (int q = 0; q < fio_queries; ++q) {
+        const char* name = list.index[fio_rng.below((int)n)]->fio;
+        for (int k = 0; k < 16; ++k) {
+            char c = (char)cp866_fold.map[(unsigned char)name[k]];
+            if (k < 12) fio_prefixes[q] += c;
+            if (k >= 10) fio_parts[q] += c;
+        }
+    }
+    std::vector<size_t> fio_found;
+    size_t fio_total = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < fio_queries; ++q) {
+        find_fio_prefix(fio, fio_prefixes[q], fio_found);
+        fio_total += fio_found.size();
+    }
+    bench_report(n, "fio_prefix", elapsed_ms(start), fio_queries, fio_total * sizeof(Record));
+
+    fio_total = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < fio_queries; ++q) {
+        find_fio_substring(fio, fio_parts[q], fio_found);
+        fio_total += fio_found.size();
+    }
+    bench_report(n, "fio_contains", elapsed_ms(start), fio_queries, fio_total * sizeof(Record));
+
+    std::string exported = filename + ".csv";
+    ExportWriter writer;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (open_export(exported.c_str(), EXPORT_CSV, writer)) {
+        export_records(writer, list.index.data(), list.index.size());
+        close_export(writer);
+    }
+    bench_report(n, "export_csv", elapsed_ms(start), writer.records, writer.bytes);
+    remove(exported.c_str());
+
+    // добавление одного процента записей: буфер сливается с отсортированным списком без пересортировки
+    list.sorted = true;
+    Rng append_rng = { 0x2545F4914F6CDD1DULL };
+    std::vector<Record> additions(std::max<size_t>(n / 100, 1));
+    for (Record& r : additions) generate_record(append_rng, r);
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (const Record& r : additions) add_delta(list, r);
+    prepare_search(list);
+    bench_report(n, "delta_merge", elapsed_ms(start), additions.size(), additions.size() * sizeof(Record));
+
+    free_database(list);
 
     std::vector<std::pair<unsigned char, double>> probs;
-    for (auto& [ch, count] : freq) {
-        probs.emplace_back(ch, static_cast<double>(count) / total);
+    CodeTable codes;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!build_fano_codes(filename.c_str(), probs, codes)) return failed("fano_codes");
+    bench_report(n, "fano_codes", elapsed_ms(start), n, bytes);
+
+    long original_size = 0, compressed_size = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!pack_fano(filename.c_str(), packed.c_str(), codes, original_size, compressed_size)) {
+        return failed("fano_pack");
+    }
+    bench_report(n, "fano_pack", elapsed_ms(start), n, bytes);
+
+    unsigned long long unpacked_size = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!unpack_fano(packed.c_str(), unpacked.c_str(), unpacked_size)) return failed("fano_unpack");
+    double unpack_ms = elapsed_ms(start);
+    if (!files_equal(filename.c_str(), unpacked.c_str())) {
+        fprintf(stderr, "fano_unpack: результат не совпадает с исходным файлом\n");
+        return failed("fano_unpack");
+    }
+    bench_report(n, "fano_unpack", unpack_ms, n, bytes);
+
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    if (!pack_fano_blocks(filename.c_str(), packed.c_str(), codes, default_block_records, opt.threads,
+                          original_size, compressed_size)) {
+        return failed("fano_pack_blocks");
+    }
+    bench_report(n, "fano_pack_blocks", elapsed_ms(start), n, bytes);
+
+    // сотня случайных выборок по 100 записей: каждая декодирует не больше двух блоков
+    const int range_queries = 100;
+    Rng rng = { n * 2654435761ULL + 1 };
+    unsigned long long range_bytes = 0;
+    reset_peak_memory();
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < range_queries; ++q) {
+        unsigned long long written = 0;
+        if (!unpack_fano_range(packed.c_str(), unpacked.c_str(), rng.below((int)n), 100, 1, written)) {
+            return failed("fano_unpack_range");
+        }
+        range_bytes += written;
+    }
+    bench_report(n, "fano_unpack_range", elapsed_ms(start), range_queries, range_bytes);
+
+    remove(unpacked.c_str());
+    remove(packed.c_str());
+    remove(filename.c_str());
+    return true;
+}
+
+int run_bench(const Options& opt) {
+    std::vector<size_t> sizes;
+    for (size_t i = 1; i < opt.args.size(); ++i) {
+        size_t n = strtoull(opt.args[i], nullptr, 10);
+        if (n > 0) sizes.push_back(n);
     }
+    if (sizes.empty()) sizes = {1000, 10000, 100000, 1000000};
 
-    std::sort(probs.begin(), probs.end(), [](auto& a, auto& b) {
-        return a.second > b.second;
-    });
+    for (size_t n : sizes) {
+        if (!bench_size(opt, n)) return 1;
+    }
+    return 0;
+}
 
-    std::map<unsigned char, std::string> codes;
-    if (!probs.empty()) {
-        if (probs.size() == 1) codes[probs[0].first] = "0";
-        else fano_split(0, probs.size() - 1, probs, codes, "");
+// Пакетный режим: одна команда без меню, результат в stdout, время фаз в stderr
+int run_batch(const Options& opt, const char* program) {
+    const std::vector<const char*>& args = opt.args;
+    const char* command = args[0];
+    if (strcmp(command, "bench") == 0) return run_bench(opt);
+    if (args.size() < 2) {
+        print_usage(program);
+        return 2;
+    }
+    const char* filename = args[1];
+
+    if (strcmp(command, "gen") == 0) {
+        size_t count = args.size() > 2 ? strtoull(args[2], nullptr, 10) : 4000;
+        unsigned long long seed = args.size() > 3 ? strtoull(args[3], nullptr, 10) : 0;
+        auto start = std::chrono::steady_clock::now();
+        if (!generate_base(filename, count, seed)) {
+            fprintf(stderr, "Ошибка записи файла %s\n", filename);
+            return 1;
+        }
+        report_phase("generate", elapsed_ms(start), count, count * sizeof(Record));
+        return 0;
+    }
+    if (strcmp(command, "serve") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        return run_service(opt, filename, args[2]);
+    }
+    if (strcmp(command, "client") == 0) {
+        ServiceRequest request = {};
+        QueryDate from, to;
+        const char* op = args.size() > 2 ? args[2] : "";
+        bool valid = true;
+        if (strcmp(op, "year") == 0 && args.size() == 4) {
+            request.op = SERVICE_YEAR;
+            request.year = atoi(args[3]);
+        } else if (strcmp(op, "house") == 0 && args.size() == 5) {
+            request.op = SERVICE_HOUSE;
+            request.year = atoi(args[3]);
+            valid = parse_int_range(args[4], request.low, request.high);
+        } else if (strcmp(op, "dates") == 0 && args.size() == 5) {
+            request.op = SERVICE_DATES;
+            valid = parse_query_date(args[3], from) && parse_query_date(args[4], to);
+            request.low = date_value(from);
+            request.high = date_value(to);
+        } else if (strcmp(op, "reload") == 0) {
+            request.op = SERVICE_RELOAD;
+        } else if (strcmp(op, "stop") == 0) {
+            request.op = SERVICE_STOP;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            print_usage(program);
+            return 2;
+        }
+        return run_service_client(filename, request);
+    }
+    if (strcmp(command, "fano") == 0) {
+        auto start = std::chrono::steady_clock::now();
+        if (!encode_fano(filename)) return 1;
+        size_t bytes = file_size(filename);
+        report_phase("fano", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        return 0;
+    }
+    if (strcmp(command, "coders") == 0) {
+        auto start = std::chrono::steady_clock::now();
+        if (!compare_coders(filename)) {
+            fprintf(stderr, "Ошибка чтения файла %s\n", filename);
+            return 1;
+        }
+        size_t bytes = file_size(filename);
+        report_phase("coders", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        return 0;
+    }
+    if (strcmp(command, "pack") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!encode_and_pack_fano(filename, args[2], opt.coder)) return 1;
+        size_t bytes = file_size(filename);
+        report_phase("pack", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        return 0;
+    }
+    if (strcmp(command, "unpack") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        auto start = std::chrono::steady_clock::now();
+        unsigned long long original_size = 0;
+        bool ok;
+        if (has_magic(filename, block_magic)) {
+            ok = unpack_fano_range(filename, args[2], 0, ~0ULL, opt.threads, original_size);
+        } else if (has_magic(filename, column_magic)) {
+            ok = unpack_columns(filename, args[2], original_size);
+        } else {
+            ok = unpack_fano(filename, args[2], original_size);
+        }
+        if (!ok) {
+            fprintf(stderr, "Ошибка распаковки файла %s\n", filename);
+            return 1;
+        }
+        report_phase("unpack", elapsed_ms(start), original_size / sizeof(Record), original_size);
+        return 0;
+    }
+    if (strcmp(command, "packb") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        unsigned block_records = args.size() > 3 ? atoi(args[3]) : default_block_records;
+        if (block_records == 0) block_records = default_block_records;
+        auto start = std::chrono::steady_clock::now();
+        if (!encode_and_pack_fano_blocks(filename, args[2], block_records, opt.threads, opt.coder)) return 1;
+        size_t bytes = file_size(filename);
+        report_phase("pack_blocks", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        return 0;
+    }
+    if (strcmp(command, "packc") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!encode_and_pack_columns(filename, args[2], opt.coder, opt.threads)) return 1;
+        size_t bytes = file_size(filename);
+        report_phase("pack_columns", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        return 0;
+    }
+    if (strcmp(command, "cfind") == 0) {
+        int year = -1;
+        const char* street = nullptr;
+        for (size_t i = 2; i + 1 < args.size(); i += 2) {
+            if (strcmp(args[i], "year") == 0) year = atoi(args[i + 1]);
+            else if (strcmp(args[i], "street") == 0) street = args[i + 1];
+            else {
+                print_usage(program);
+                return 2;
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<size_t> matches;
+        if (!filter_columns(filename, year, street, matches)) {
+            fprintf(stderr, "Ошибка чтения колоночного архива %s\n", filename);
+            return 1;
+        }
+        report_phase("column_filter", elapsed_ms(start), matches.size(), matches.size() * sizeof(Record));
+        for (size_t i : matches) printf("%zu\n", i);
+        return 0;
+    }
+    if (strcmp(command, "unpackr") == 0) {
+        if (args.size() < 5) {
+            print_usage(program);
+            return 2;
+        }
+        auto start = std::chrono::steady_clock::now();
+        unsigned long long written = 0;
+        if (!unpack_fano_range(filename, args[2], strtoull(args[3], nullptr, 10),
+                               strtoull(args[4], nullptr, 10), opt.threads, written)) {
+            fprintf(stderr, "Ошибка распаковки файла %s\n", filename);
+            return 1;
+        }
+        report_phase("unpack_range", elapsed_ms(start), written / sizeof(Record), written);
+        return 0;
+    }
+    if (strcmp(command, "extsort") == 0) {
+        if (args.size() < 3) {
+            print_usage(program);
+            return 2;
+        }
+        size_t budget_mb = 64;
+        if (args.size() > 3) {
+            char* end = nullptr;
+            errno = 0;
+            long value = strtol(args[3], &end, 10);
+            if (errno != 0 || end == args[3] || *end != '\0' || value <= 0 ||
+                (unsigned long)value > (SIZE_MAX >> 20)) {
+                print_usage(program);
+                return 2;
+            }
+            budget_mb = value;
+        }
+        size_t bytes = file_size(filename);
+        auto start = std::chrono::steady_clock::now();
+        size_t runs = 0;
+        if (!external_sort(filename, args[2], budget_mb << 20, &runs)) return 1;
+        report_phase("extsort", elapsed_ms(start), bytes / sizeof(Record), bytes);
+        fprintf(stderr, "{\"phase\":\"extsort_runs\",\"runs\":%zu}\n", runs);
+        return 0;
     }
 
-    printf("\n+--------+-------------+--------+----------------------------+\n");
-    printf("| Символ | Вероятность | Длина  | Код Фано                   |\n");
-    printf("+--------+-------------+--------+----------------------------+\n");
-    
-    double avgLen = 0.0, entropy = 0.0;
+    if (strcmp(command, "snapshot") == 0) {
+        Options fresh = opt;
+        fresh.use_snapshot = false;
+        Database db;
+        if (!batch_load(fresh, filename, db)) return 1;
+        batch_sort(fresh, db);
+        auto start = std::chrono::steady_clock::now();
+        bool ok = save_snapshot(filename, db);
+        report_phase("snapshot", elapsed_ms(start), db.count, db.count * sizeof(Record));
+        free_database(db);
+        if (!ok) {
+            fprintf(stderr, "Ошибка записи снимка %s\n", snapshot_name(filename).c_str());
+            return 1;
+        }
+        return 0;
+    }
 
-    for (auto& [ch, p] : probs) {
-        const std::string& code = codes[ch];
-        int l = (int)code.length();
-        avgLen += p * l;
-        if (p > 0) entropy += -p * std::log2(p);
+    if (strcmp(command, "query") == 0) {
+        Query q;
+        for (size_t i = 2; i < args.size(); i += 2) {
+            if (i + 1 >= args.size() || !add_query_condition(q, args[i], args[i + 1])) {
+                fprintf(stderr, "Неверное условие запроса '%s'\n", args[i]);
+                return 2;
+            }
+        }
+        Database db;
+        if (!batch_load(opt, filename, db)) return 1;
+        batch_sort(opt, db);
+
+        auto start = std::chrono::steady_clock::now();
+        FieldIndexes fields;
+        build_field_indexes(db.index, fields);
+        report_phase("field_indexes", elapsed_ms(start), db.count, db.count * 2 * sizeof(size_t));
+
+        start = std::chrono::steady_clock::now();
+        QueryCursor cursor = run_query(db.index, db.dates, fields, q);
+        fprintf(stderr, "{\"phase\":\"plan\",\"source\":\"%s\",\"candidates\":%zu}\n",
+                query_source_name(cursor.plan.source), cursor.plan.candidates);
+        size_t found = 0;
+        for (Record* r = cursor.next(); r; r = cursor.next()) {
+            print_record_line(r);
+            ++found;
+        }
+        report_phase("query", elapsed_ms(start), found, found * sizeof(Record));
+        free_database(db);
+        return 0;
+    }
 
-        std::string name = symbol_name(ch);
+    if (strcmp(command, "append") == 0) {
+        Record single;
+        bool from_file = args.size() == 3;
+        if (!from_file && (args.size() != 7 ||
+                           !make_record(args[2], args[3], atoi(args[4]), atoi(args[5]), args[6], single))) {
+            print_usage(program);
+            return 2;
+        }
+        FILE* source = from_file ? fopen(args[2], "rb") : nullptr;
+        if (from_file && !source) {
+            fprintf(stderr, "Ошибка открытия файла %s\n", args[2]);
+            return 1;
+        }
 
-        printf("| %-6s | %10.6f | %7d | %-24s |\n",
-               name.c_str(), p, l, code.c_str());
+        Database db;
+        if (!batch_load(opt, filename, db)) {
+            if (source) fclose(source);
+            return 1;
+        }
+        batch_sort(opt, db);
+        prepare_search(db);
+
+        auto start = std::chrono::steady_clock::now();
+        size_t appended = 0;
+        bool ok = true;
+        if (from_file) {
+            std::vector<Record> chunk(default_block_records);
+            size_t n;
+            while (ok && (n = fread(chunk.data(), sizeof(Record), chunk.size(), source)) > 0) {
+                ok = append_records(filename, db, chunk.data(), n);
+                if (ok) appended += n;
+            }
+            fclose(source);
+        } else {
+            ok = append_records(filename, db, &single, 1);
+            if (ok) appended = 1;
+        }
+        report_phase("append", elapsed_ms(start), appended, appended * sizeof(Record));
+
+        start = std::chrono::steady_clock::now();
+        prepare_search(db);
+        report_phase("delta_merge", elapsed_ms(start), db.count, db.count * sizeof(Record*));
+
+        // снимок сохраняется заново, иначе следующий запуск отсортирует всё с нуля
+        if (ok && opt.use_snapshot) {
+            start = std::chrono::steady_clock::now();
+            ok = save_snapshot(filename, db);
+            report_phase("snapshot", elapsed_ms(start), db.count, db.count * sizeof(Record));
+        }
+        free_database(db);
+        if (!ok) {
+            fprintf(stderr, "Ошибка записи файла %s\n", filename);
+            return 1;
+        }
+        return 0;
     }
 
-    printf("+--------+-------------+--------+----------------------------+\n");
-    printf("Энтропия: H = %.6f бит/символ\n", entropy);
-    printf("Средняя длина кода: L = %.6f бит/символ\n", avgLen);
-    printf("Избыточность: R = L - H = %.6f\n", avgLen - entropy);
-    size_t unique_count = probs.size();
-    printf("Кол-во уник символов: %zu\n", unique_count);
-}
+    if (strcmp(command, "export") == 0) {
+        ExportFormat format = EXPORT_CSV;
+        int year = -1, low = 0, high = 0;
+        bool by_year = args.size() >= 6 && strcmp(args[4], "year") == 0;
+        bool by_house = by_year && args.size() >= 8 && strcmp(args[6], "house") == 0;
+        if (args.size() < 4 || !parse_export_format(args[2], format) ||
+            (args.size() > 4 && !by_year) || (args.size() > 6 && !by_house) ||
+            (by_house && !parse_int_range(args[7], low, high))) {
+            print_usage(program);
+            return 2;
+        }
+        if (by_year) year = atoi(args[5]);
 
-void encode_and_pack_fano(const char* input_filename, const char* output_filename) {
-    FILE* file = fopen(input_filename, "rb");
-    if (!file) {
-        printf("Ошибка открытия файла '%s'\n", input_filename);
-        return;
+        Database db;
+        if (!batch_load(opt, filename, db)) return 1;
+        batch_sort(opt, db);
+
+        ExportWriter writer;
+        if (!open_export(args[3], format, writer)) {
+            fprintf(stderr, "Ошибка создания файла %s\n", args[3]);
+            free_database(db);
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (by_house) {
+            IndexRange selection = year_range(db.index, db.dates, year);
+            AVLNode* root = nullptr;
+            for (size_t i = selection.begin; i < selection.end; ++i) root = insert(root, db.index[i]);
+            export_houses(writer, root, low, high);
+            free_tree(root);
+        } else if (by_year) {
+            IndexRange selection = year_range(db.index, db.dates, year);
+            export_records(writer, db.index.data() + selection.begin, selection.size());
+        } else if (db.head) {
+            export_list(writer, db.head);
+        } else {
+            export_records(writer, db.index.data(), db.index.size());
+        }
+        bool ok = close_export(writer);
+        report_phase("export", elapsed_ms(start), writer.records, writer.bytes);
+        free_database(db);
+        if (!ok) {
+            fprintf(stderr, "Ошибка записи файла %s\n", args[3]);
+            return 1;
+        }
+        return 0;
     }
 
-    std::map<unsigned char, int> freq;
-    int total = 0;
-    int c;
-    while ((c = fgetc(file)) != EOF) {
-        freq[(unsigned char)c]++;
-        total++;
+    if (strcmp(command, "fio") == 0) {
+        bool prefix = args.size() >= 4 && strcmp(args[2], "prefix") == 0;
+        bool contains = args.size() >= 4 && strcmp(args[2], "contains") == 0;
+        if (!prefix && !contains) {
+            print_usage(program);
+            return 2;
+        }
+        Database db;
+        if (!batch_load(opt, filename, db)) return 1;
+        batch_sort(opt, db);
+
+        auto start = std::chrono::steady_clock::now();
+        FioIndex fio;
+        build_fio_index(db.index, fio);
+        report_phase("fio_index", elapsed_ms(start), db.count, fio.text.size() + fio.postings.size() * sizeof(unsigned));
+
+        start = std::chrono::steady_clock::now();
+        std::vector<size_t> found;
+        {
+            ScopedTimer timer(TIMER_QUERY);
+            if (prefix) find_fio_prefix(fio, fold_query(args[3]), found);
+            else find_fio_substring(fio, fold_query(args[3]), found);
+        }
+        for (size_t i : found) print_record_line(db.index[i]);
+        report_phase("fio_search", elapsed_ms(start), found.size(), found.size() * sizeof(Record));
+        free_database(db);
+        return 0;
     }
-    fclose(file);
 
-    std::vector<std::pair<unsigned char, double>> probs;
-    for (auto& [ch, count] : freq) {
-        probs.emplace_back(ch, static_cast<double>(count) / total);
+    bool is_load = strcmp(command, "load") == 0;
+    bool is_sort = strcmp(command, "sort") == 0;
+    bool is_year = strcmp(command, "year") == 0 && args.size() >= 3;
+    bool is_house = strcmp(command, "house") == 0 && args.size() >= 4;
+    bool is_dates = strcmp(command, "dates") == 0 && args.size() >= 4;
+    bool is_houses = strcmp(command, "houses") == 0 && args.size() >= 5;
+    QueryDate from = {}, to = {};
+    if (is_dates && (!parse_query_date(args[2], from) || !parse_query_date(args[3], to))) {
+        fprintf(stderr, "Даты задаются в виде дд.мм.гг или дд-мм-гг\n");
+        return 2;
+    }
+    if (!is_load && !is_sort && !is_year && !is_house && !is_dates && !is_houses) {
+        print_usage(program);
+        return 2;
     }
 
-    std::sort(probs.begin(), probs.end(), [](auto& a, auto& b) {
-        return a.second > b.second;
-    });
+    Database db;
+    if (!batch_load(opt, filename, db)) return 1;
 
-    std::map<unsigned char, std::string> codes;
-    if (!probs.empty()) {
-         if (probs.size() == 1) codes[probs[0].first] = "0";
-         else fano_split(0, probs.size() - 1, probs, codes, "");
+    if (is_load) {
+        printf("%zu\n", db.count);
+    } else {
+        batch_sort(opt, db);
     }
 
-    file = fopen(input_filename, "rb");
-    FILE* out = fopen(output_filename, "wb");
-    if (!file || !out) {
-        printf("Ошибка работы с файлами.\n");
-        return;
+    if (is_sort) {
+        auto start = std::chrono::steady_clock::now();
+        print_record_lines(db.index.data(), db.index.size());
+        report_phase("output", elapsed_ms(start), db.index.size(), db.index.size() * sizeof(Record));
     }
 
-    unsigned char buffer = 0;
-    int bit_count = 0;
-    long original_bits = 0;
-    long compressed_bits = 0;
+    if (is_year || is_house || is_dates) {
+        IndexRange result = is_dates ? batch_dates(db, from, to) : batch_year(db, atoi(args[2]));
 
-    while ((c = fgetc(file)) != EOF) {
-        unsigned char byte = (unsigned char)c;
-        const std::string& code = codes[byte];
-        original_bits += 8;
-        compressed_bits += code.length();
+        if (!is_house) {
+            auto start = std::chrono::steady_clock::now();
+            size_t n = result.size();
+            print_record_lines(db.index.data() + result.begin, n);
+            report_phase("output", elapsed_ms(start), n, n * sizeof(Record));
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            AVLNode* root = nullptr;
+            size_t n = result.size();
+            for (size_t i = result.begin; i < result.end; ++i) root = insert(root, db.index[i]);
+            report_phase("avl_build", elapsed_ms(start), n, n * sizeof(Record));
 
-        for (char bit : code) {
-            buffer <<= 1;
-            if (bit == '1') buffer |= 1;
-            bit_count++;
+            start = std::chrono::steady_clock::now();
+            AVLNode* found = search(root, atoi(args[3]));
+            size_t found_count = found ? found->residents.size() : 0;
+            report_phase("avl_search", elapsed_ms(start), found_count, found_count * sizeof(Record));
 
-            if (bit_count == 8) {
-                fwrite(&buffer, 1, 1, out);
-                bit_count = 0;
-                buffer = 0;
+            if (found) {
+                for (const Record* r : found->residents) print_record_line(r);
             }
+            free_tree(root);
         }
     }
 
-    if (bit_count > 0) {
-        buffer <<= (8 - bit_count);
-        fwrite(&buffer, 1, 1, out);
+    if (is_houses) {
+        AVLNode* root = nullptr;
+        IndexRange selection = batch_year(db, atoi(args[2]));
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = selection.begin; i < selection.end; ++i) root = insert(root, db.index[i]);
+        report_phase("avl_build", elapsed_ms(start), selection.size(), selection.size() * sizeof(Record));
+
+        start = std::chrono::steady_clock::now();
+        size_t found_count = 0;
+        for_each_house(root, atoi(args[3]), atoi(args[4]), [&](AVLNode* node) {
+            for (const Record* r : node->residents) print_record_line(r);
+            found_count += node->residents.size();
+            return true;
+        });
+        report_phase("avl_range", elapsed_ms(start), found_count, found_count * sizeof(Record));
+        free_tree(root);
     }
 
-    fclose(file);
-    fclose(out);
-
-    long original_size = original_bits / 8;
-    long compressed_size = (compressed_bits + 7) / 8;
-
-    printf("\nСжатие завершено.\n");
-    printf("Исходный размер: %ld байт\n", original_size);
-    printf("Сжатый размер:   %ld байт\n", compressed_size);
-    printf("Коэффициент сжатия: %.3fx\n", (double)original_size / compressed_size);
+    free_database(db);
+    return 0;
 }
 
-int main() {
-    FILE* file = fopen("testBase4.dat", "rb");
-    if (!file) {
-        printf("Ошибка открытия файла testBase4.dat\n");
-        return 1;
+int main(int argc, char* argv[]) {
+    Options opt;
+    opt.use_mmap = false;
+    opt.use_snapshot = true;
+    opt.threads = default_thread_count();
+    opt.engine = SORT_NATURAL;
+    opt.coder = CODER_FANO;
+    opt.filename = "testBase4.dat";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mmap") == 0) opt.use_mmap = true;
+        else if (strcmp(argv[i], "--no-snapshot") == 0) opt.use_snapshot = false;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) opt.threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) opt.filename = argv[++i];
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats.enabled = true;
+            stats_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (!parse_sort_engine(argv[++i], opt.engine)) {
+                fprintf(stderr, "Неизвестный метод сортировки '%s' (natural, parallel, radix)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--coder") == 0 && i + 1 < argc) {
+            if (!parse_coder_engine(argv[++i], opt.coder)) {
+                fprintf(stderr, "Неизвестный кодер '%s' (fano, huffman)\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        else opt.args.push_back(argv[i]);
     }
+    if (opt.use_mmap && opt.engine == SORT_NATURAL) opt.engine = SORT_PARALLEL;
+    if (stats_path) atexit(write_stats_on_exit);
 
-    ListNode* head = nullptr;
-    ListNode* tail = nullptr;
-    Record temp;
-    
-    while (fread(&temp, sizeof(Record), 1, file) == 1) {
-        ListNode* newNode = new ListNode(temp);
-        if (!head) {
-            head = tail = newNode;
-        } else {
-            tail->next = newNode;
-            tail = newNode;
-        }
+    if (!opt.args.empty()) return run_batch(opt, argv[0]);
+
+    const char* filename = opt.filename;
+    Database db;
+    bool from_snapshot = opt.use_snapshot && load_snapshot(filename, db);
+    if (!from_snapshot && !load_database(filename, opt.use_mmap, db)) {
+        printf("Ошибка открытия файла %s\n", filename);
+        return 1;
     }
-    fclose(file);
 
     ::queue<Record*> search_queue_result;
-    std::vector<Record*> index_array;
-    bool is_sorted = false;
+    bool is_sorted = db.sorted;
+    AVLNode* house_tree = nullptr;
+    bool house_tree_stale = true;
+    FieldIndexes fields;
+    bool fields_stale = true;
+    FioIndex fio;
+    bool fio_stale = true;
+    // границы дат текущей выборки (yymmdd): добавленные в них записи попадают в выборку и дерево
+    int selection_low = 1, selection_high = 0;
+    size_t unsaved_appends = 0;
 
     while (true) {
         clear_screen();
         printf("=== МЕНЮ ===\n");
+        if (from_snapshot) printf("(база загружена из снимка '%s', уже отсортирована)\n", snapshot_name(filename).c_str());
         printf("1. Просмотр списка\n");
-        printf("2. Сортировка списка (Прямое слияние очередей)\n");
+        printf("2. Сортировка списка (%s)\n", sort_engine_title(opt.engine));
         printf("3. Построение индексного массива и Поиск по году\n");
         printf("4. Построить АВЛ-дерево из результатов поиска\n");
         printf("5. Кодирование (Фано)\n");
-        printf("6. Упаковать файл (сжатие Фано)\n");
+        printf("6. Упаковать файл (сжатие %s)\n", coder_engine_title(opt.coder));
+        printf("8. Распаковать файл\n");
+        printf("9. Сравнение кодеров (Фано, Хаффман)\n");
+        printf("a. Поиск по диапазону дат\n");
+        printf("b. Составной запрос (год, даты, улица, дом, квартира)\n");
+        printf("c. Поиск по ФИО (начало или часть)\n");
+        printf("d. Экспорт в CSV или JSON Lines\n");
+        printf("e. Добавить запись\n");
+        printf("f. Статистика замеров (JSON)%s\n", stats.enabled ? "" : " — сейчас выключена");
+        printf("g. Внешняя сортировка файла\n");
         printf("7. Выход\n");
-        printf("\nВыберите действие (1-7): ");
+        printf("\n");
+        print_pool_stats();
+        printf("\nВыберите действие (1-9, a-g): ");
 
         int choice = getch();
 
         if (choice == '1') {
-            print_pages(head);
+            merge_delta(db);
+            if (db.use_mmap) print_index_pages(db.index);
+            else print_pages(db.head);
         }
         else if (choice == '2') {
             clear_screen();
-            mergeSort(head);
+            sort_database(db, opt.engine, opt.threads);
             is_sorted = true;
-            index_array.clear(); 
-            print_pages(head);
+            fields_stale = true;
+            fio_stale = true;
+            // отсортированный порядок сохраняется для следующего запуска
+            if (opt.use_snapshot && !save_snapshot(filename, db)) {
+                printf("Не удалось записать снимок '%s', при следующем запуске база будет отсортирована заново.\n",
+                       snapshot_name(filename).c_str());
+                printf("Нажмите любую клавишу...");
+                getch();
+            }
+            if (db.use_mmap) print_index_pages(db.index);
+            else print_pages(db.head);
         }
         else if (choice == '3') {
             if (!is_sorted) {
@@ -920,24 +6008,31 @@ int main() {
                 continue;
             }
 
-            if (index_array.empty()) {
-                printf("Построение индексного массива...\n");
-                index_array = build_index(head);
-            }
+            if (db.index.empty() || db.dates.offsets.empty()) printf("Построение индексного массива...\n");
+            prepare_search(db);
 
             clear_screen();
             printf("Введите год (93-97): ");
             int year = 0;
             scanf("%d", &year);
-            
+            while (getchar() != '\n');
+
+            IndexRange found;
+            {
+                ScopedTimer timer(TIMER_QUERY);
+                found = year_range(db.index, db.dates, year);
+            }
             search_queue_result = ::queue<Record*>();
-            search_queue_result = search_with_index(index_array, year);
+            house_tree_stale = true;
+            selection_low = date_value(QueryDate{ 1, 1, year });
+            selection_high = date_value(QueryDate{ 31, 12, year });
+            for (size_t i = found.begin; i < found.end; ++i) search_queue_result.push(db.index[i]);
 
             if (search_queue_result.empty()) {
                 printf("Записей за этот год не найдено.\n");
                 getch();
             } else {
-                print_queue_pages(search_queue_result);
+                print_index_pages(db.index.data() + found.begin, found.size());
             }
         }
         else if (choice == '4') {
@@ -948,45 +6043,373 @@ int main() {
                 continue;
             }
 
-            AVLNode* root = nullptr;
-            ::queue<Record*> buildQ = search_queue_result;
-            
-            while (!buildQ.empty()) {
-                root = insert(root, buildQ.front());
-                buildQ.pop();
+            // дерево живёт между вызовами и перестраивается только после нового поиска
+            if (house_tree_stale) {
+                free_tree(house_tree);
+                house_tree = nullptr;
+                for (::queue<Record*> buildQ = search_queue_result; !buildQ.empty(); buildQ.pop()) {
+                    house_tree = insert(house_tree, buildQ.front());
+                }
+                house_tree_stale = false;
             }
 
-            printTree(root, "", true);
+            printTree(house_tree, "", true);
             
-            printf("\n-- Поиск в дереве --\nВведите номер дома: ");
-            int query_house;
-            scanf("%d", &query_house);
+            printf("\n-- Поиск в дереве --\nВведите номер дома или диапазон (A-B): ");
+            char query[32] = {};
+            scanf("%31s", query);
             while (getchar() != '\n');
-            
-            AVLNode* found = search(root, query_house);
-            if (found) {
-                printf("\nВ доме %d найдены жильцы:\n", found->house_key);
-                for (const Record* r : found->residents) {
-                    printf("  ФИО: %s | Кв: %d\n", cp866_to_utf8(r->fio, 32).c_str(), r->flat);
+
+            int low = 0, high = 0;
+            int parsed = sscanf(query, "%d-%d", &low, &high);
+            if (parsed == 1) {
+                AVLNode* found = search(house_tree, low);
+                if (found) {
+                    printf("\nВ доме %d найдены жильцы:\n", found->house_key);
+                    for (const Record* r : found->residents) {
+                        printf("  ФИО: %s | Кв: %d\n", cp866_to_utf8(r->fio, 32).c_str(), r->flat);
+                    }
+                } else {
+                    printf("Дом %d не найден в выборке.\n", low);
                 }
+            } else if (parsed == 2) {
+                // выводится не больше экрана жильцов, дальше обход останавливается
+                const int max_lines = 40;
+                int lines = 0;
+                bool complete = for_each_house(house_tree, low, high, [&](AVLNode* node) {
+                    for (const Record* r : node->residents) {
+                        if (lines == max_lines) return false;
+                        printf("  Дом: %-5d | Кв: %-5d | ФИО: %s\n", node->house_key, r->flat,
+                               cp866_to_utf8(r->fio, 32).c_str());
+                        ++lines;
+                    }
+                    return true;
+                });
+                if (lines == 0) printf("Домов с %d по %d в выборке нет.\n", low, high);
+                if (!complete) printf("  ... (показаны первые %d жильцов)\n", max_lines);
             } else {
-                printf("Дом %d не найден в выборке.\n", query_house);
+                printf("Неверный запрос.\n");
             }
             getch();
         }
         else if (choice == '5') {
             clear_screen();
-            printf("Кодирование файла 'testBase4.dat' методом ФАНО:\n");
-            encode_fano("testBase4.dat");
+            printf("Кодирование файла '%s' методом ФАНО:\n", filename);
+            encode_fano(filename);
             getch();
         }
         else if (choice == '6') {
             clear_screen();
-            encode_and_pack_fano("testBase4.dat", "packed_base.bin");
+            encode_and_pack_fano(filename, "packed_base.bin", opt.coder);
+            getch();
+        }
+        else if (choice == 'g') {
+            clear_screen();
+            printf("Лимит памяти для внешней сортировки (МБ): ");
+            int budget_mb = 0;
+            scanf("%d", &budget_mb);
+            while (getchar() != '\n');
+            if (budget_mb <= 0) budget_mb = 1;
+
+            size_t runs = 0;
+            if (external_sort(filename, "sorted_base.dat", (size_t)budget_mb << 20, &runs)) {
+                printf("Файл отсортирован в 'sorted_base.dat' (серий: %zu)\n", runs);
+            }
+            getch();
+        }
+        else if (choice == '8') {
+            clear_screen();
+            decode_and_unpack_fano("packed_base.bin", "unpacked_base.dat");
+            if (files_equal(filename, "unpacked_base.dat")) {
+                printf("Проверка: распакованный файл совпадает с '%s'\n", filename);
+            } else {
+                printf("Проверка: распакованный файл отличается от '%s'\n", filename);
+            }
+            getch();
+        }
+        else if (choice == '9') {
+            clear_screen();
+            if (!compare_coders(filename)) printf("Ошибка чтения файла '%s'\n", filename);
+            getch();
+        }
+        else if (choice == 'a') {
+            clear_screen();
+            if (!is_sorted) {
+                printf("ОШИБКА: Выполните пункт 2\n");
+                printf("Нажмите любую клавишу...");
+                getch();
+                continue;
+            }
+            prepare_search(db);
+
+            printf("Введите диапазон дат (дд.мм.гг дд.мм.гг): ");
+            char from_text[16] = {}, to_text[16] = {};
+            QueryDate from, to;
+            scanf("%15s %15s", from_text, to_text);
+            while (getchar() != '\n');
+            if (!parse_query_date(from_text, from) || !parse_query_date(to_text, to)) {
+                printf("Неверный формат даты.\n");
+                getch();
+                continue;
+            }
+
+            IndexRange found;
+            {
+                ScopedTimer timer(TIMER_QUERY);
+                found = date_range(db.index, db.dates, from, to);
+            }
+            search_queue_result = ::queue<Record*>();
+            house_tree_stale = true;
+            selection_low = date_value(from);
+            selection_high = date_value(to);
+            for (size_t i = found.begin; i < found.end; ++i) search_queue_result.push(db.index[i]);
+
+            if (found.size() == 0) {
+                printf("Записей в этом диапазоне не найдено.\n");
+                getch();
+            } else {
+                print_index_pages(db.index.data() + found.begin, found.size());
+            }
+        }
+        else if (choice == 'b') {
+            clear_screen();
+            if (!is_sorted) {
+                printf("ОШИБКА: Выполните пункт 2\n");
+                printf("Нажмите любую клавишу...");
+                getch();
+                continue;
+            }
+            prepare_search(db);
+            if (fields_stale) {
+                build_field_indexes(db.index, fields);
+                fields_stale = false;
+            }
+
+            printf("Составной запрос (Enter — условие не задано)\n");
+            const char* const prompts[][2] = {
+                {"year", "Год (ГГ): "}, {"from", "Дата с (дд.мм.гг): "}, {"to", "Дата по (дд.мм.гг): "},
+                {"street", "Улица: "}, {"house", "Дом или диапазон A-B: "}, {"flat", "Квартира или диапазон A-B: "}
+            };
+            Query q;
+            bool valid = true;
+            for (const auto& prompt : prompts) {
+                printf("%s", prompt[1]);
+                char line[64] = {};
+                if (!fgets(line, sizeof(line), stdin)) break;
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] && !add_query_condition(q, prompt[0], line)) {
+                    printf("Неверное значение '%s'\n", line);
+                    valid = false;
+                    break;
+                }
+            }
+            if (!valid) {
+                getch();
+                continue;
+            }
+
+            // результаты берутся из курсора постранично, по мере листания
+            QueryCursor cursor = run_query(db.index, db.dates, fields, q);
+            const int page_size = 20;
+            int page = 0;
+            Record* r = cursor.next();
+            while (true) {
+                clear_screen();
+                printf("План: %s, кандидатов %zu. Страница %d\n",
+                       query_source_name(cursor.plan.source), cursor.plan.candidates, page + 1);
+                printf("+--------------------------------+--------------------+-------+-------+------------+\n");
+                printf("|              ФИО               |       Улица        | Дом   | Кв.   |    Дата    |\n");
+                printf("+--------------------------------+--------------------+-------+-------+------------+\n");
+                for (int i = 0; i < page_size && r; ++i, r = cursor.next()) {
+                    printf("| %-30s", cp866_to_utf8(r->fio, 32).c_str());
+                    printf("| %-18s", cp866_to_utf8(r->street, 18).c_str());
+                    printf("| %-5d", r->house);
+                    printf("| %-5d", r->flat);
+                    printf("| %-10s |\n", cp866_to_utf8(r->settleDate, 10).c_str());
+                }
+                printf("+--------------------------------+--------------------+-------+-------+------------+\n");
+                if (!r) {
+                    printf("Конец выборки. Нажмите любую клавишу...");
+                    getch();
+                    break;
+                }
+                printf("[Enter] След. стр.  [ESC] Выход\n");
+                int key = getch();
+                if (key == 27) break;
+                ++page;
+            }
+        }
+        else if (choice == 'c') {
+            clear_screen();
+            if (!is_sorted) {
+                printf("ОШИБКА: Выполните пункт 2\n");
+                printf("Нажмите любую клавишу...");
+                getch();
+                continue;
+            }
+            prepare_search(db);
+            if (fio_stale) {
+                printf("Построение индекса ФИО...\n");
+                build_fio_index(db.index, fio);
+                fio_stale = false;
+            }
+
+            printf("1. ФИО начинается с\n2. ФИО содержит\nВыберите: ");
+            int mode = getch();
+            printf("\nТекст: ");
+            char line[64] = {};
+            if (!fgets(line, sizeof(line), stdin)) continue;
+            line[strcspn(line, "\r\n")] = '\0';
+
+            std::vector<size_t> found;
+            {
+                ScopedTimer timer(TIMER_QUERY);
+                if (mode == '2') find_fio_substring(fio, fold_query(line), found);
+                else find_fio_prefix(fio, fold_query(line), found);
+            }
+            if (found.empty()) {
+                printf("Записей не найдено.\n");
+                getch();
+                continue;
+            }
+            std::vector<Record*> records(found.size());
+            for (size_t i = 0; i < found.size(); ++i) records[i] = db.index[found[i]];
+            print_index_pages(records);
+        }
+        else if (choice == 'd') {
+            clear_screen();
+            printf("Что выгрузить:\n1. Весь список\n2. Результаты поиска (пункт 3 или a)\n"
+                   "3. Диапазон домов из АВЛ-дерева (пункт 4)\nВыберите: ");
+            int source = getch();
+            if (source == '2' && search_queue_result.empty()) {
+                printf("\nОшибка: Сначала выполните поиск!\n");
+                getch();
+                continue;
+            }
+            if (source == '3' && (!house_tree || house_tree_stale)) {
+                printf("\nОшибка: Сначала постройте дерево (пункт 4)!\n");
+                getch();
+                continue;
+            }
+            if (source != '1' && source != '2' && source != '3') continue;
+
+            int low = 0, high = 0;
+            if (source == '3') {
+                printf("\nДом или диапазон домов (A-B): ");
+                char range[32] = {};
+                scanf("%31s", range);
+                while (getchar() != '\n');
+                if (!parse_int_range(range, low, high)) {
+                    printf("Неверный диапазон.\n");
+                    getch();
+                    continue;
+                }
+            }
+
+            printf("\nФормат (csv или jsonl) и имя файла: ");
+            char format_name[16] = {}, path[256] = {};
+            scanf("%15s %255s", format_name, path);
+            while (getchar() != '\n');
+            ExportFormat format;
+            if (!parse_export_format(format_name, format)) {
+                printf("Неизвестный формат '%s'.\n", format_name);
+                getch();
+                continue;
+            }
+
+            ExportWriter writer;
+            if (!open_export(path, format, writer)) {
+                printf("Ошибка создания файла %s\n", path);
+                getch();
+                continue;
+            }
+            if (source == '1') {
+                if (db.head) export_list(writer, db.head);
+                else export_records(writer, db.index.data(), db.index.size());
+            } else if (source == '2') {
+                export_queue(writer, search_queue_result);
+            } else {
+                export_houses(writer, house_tree, low, high);
+            }
+            size_t exported = writer.records;
+            if (close_export(writer)) printf("Выгружено записей: %zu в файл %s\n", exported, path);
+            else printf("Ошибка записи файла %s\n", path);
+            getch();
+        }
+        else if (choice == 'e') {
+            clear_screen();
+            printf("Новая запись\n");
+            const char* const prompts[] = { "ФИО: ", "Улица: ", "Дом: ", "Квартира: ", "Дата заселения (дд.мм.гг): " };
+            char fields_text[5][96] = {};
+            bool entered = true;
+            for (int i = 0; i < 5 && entered; ++i) {
+                printf("%s", prompts[i]);
+                entered = fgets(fields_text[i], sizeof(fields_text[i]), stdin) != nullptr;
+                fields_text[i][strcspn(fields_text[i], "\r\n")] = '\0';
+            }
+            Record r;
+            if (!entered || !make_record(fields_text[0], fields_text[1], atoi(fields_text[2]), atoi(fields_text[3]),
+                                         fields_text[4], r)) {
+                printf("Неверные данные записи.\n");
+                getch();
+                continue;
+            }
+            if (!append_to_file(filename, &r, 1)) {
+                printf("Ошибка записи файла %s\n", filename);
+                getch();
+                continue;
+            }
+            Record* stored = add_delta(db, r);
+            ++unsaved_appends;
+            fields_stale = true;
+            fio_stale = true;
+            // запись сразу видна в текущей выборке и в дереве домов, не дожидаясь слияния
+            int value = date_value(r.settleDate);
+            if (value >= selection_low && value <= selection_high) {
+                // выборка идёт в порядке индекса: запись встаёт после всех, что не больше неё
+                ::queue<Record*> merged;
+                bool placed = false;
+                while (!search_queue_result.empty()) {
+                    Record* next = search_queue_result.front();
+                    if (!placed && recordLess(*stored, *next)) {
+                        merged.push(stored);
+                        placed = true;
+                    }
+                    merged.push(next);
+                    search_queue_result.pop();
+                }
+                if (!placed) merged.push(stored);
+                search_queue_result = std::move(merged);
+                if (house_tree && !house_tree_stale) house_tree = insert(house_tree, stored);
+            }
+            if (db.delta.empty()) printf("Запись добавлена, буфер добавлений слит с базой.\n");
+            else printf("Запись добавлена, в буфере добавлений %zu записей.\n", db.delta.size());
+            getch();
+        }
+        else if (choice == 'f') {
+            clear_screen();
+            if (!stats.enabled) {
+                stats.enabled = true;
+                printf("Сбор статистики включён: счётчики и таймеры считаются с этого момента.\n");
+            } else {
+                dump_stats(stdout);
+                if (stats_path && !write_stats(stats_path)) printf("Ошибка записи статистики в %s\n", stats_path);
+                else if (stats_path) printf("Сохранено в %s\n", stats_path);
+            }
+            printf("Нажмите любую клавишу...");
             getch();
         }
         else if (choice == '7') {
-            free_list(head);
+            // снимок обновляется, чтобы добавленные записи не требовали полной сортировки при запуске
+            if (unsaved_appends > 0 && is_sorted && opt.use_snapshot) {
+                prepare_search(db);
+                if (!save_snapshot(filename, db)) {
+                    printf("Не удалось записать снимок '%s', добавленные записи будут отсортированы при следующем запуске.\n",
+                           snapshot_name(filename).c_str());
+                }
+            }
+            free_tree(house_tree);
+            free_database(db);
             break;
         }
         else{